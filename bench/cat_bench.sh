@@ -0,0 +1,40 @@
+#!/bin/sh
+# MB/s of the builtin cat against /bin/cat, file to pipe and file to file.
+# Prints one JSON object per case, like bench/run_bench.sh.
+# usage: bench/cat_bench.sh [megabytes] (run from the repo root after make)
+
+MB=${1:-256}
+SSHELL=${SSHELL:-./sshell}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+head -c "${MB}M" /dev/urandom > "$WORK/in"
+cat "$WORK/in" > /dev/null # page cache warm, so both read from memory
+
+measure() {
+    # measure <case> <cat> <line>: runs the line through sshell three times and keeps the best
+    best=0
+    for run in 1 2 3; do
+        rm -f "$WORK/out"
+        echo "$3" > "$WORK/script.sh"
+        start=$(date +%s%N)
+        (cd "$WORK" && "$OLDPWD/$SSHELL" < script.sh > /dev/null 2>&1)
+        end=$(date +%s%N)
+        ns=$((end - start))
+        if [ "$best" -eq 0 ] || [ "$ns" -lt "$best" ]; then
+            best=$ns
+        fi
+    done
+    awk -v name="$1" -v cat="$2" -v mb="$MB" -v ns="$best" 'BEGIN {
+        printf "{\"workload\":\"%s\",\"cat\":\"%s\",\"megabytes\":%d,\"seconds\":%.4f,\"mb_per_sec\":%.1f}\n",
+               name, cat, mb, ns / 1e9, mb / (ns / 1e9)
+    }'
+}
+
+# the pipe is drained by a second stage that does nothing with the data
+for cat in /bin/cat cat; do
+    measure file_to_pipe "$cat" "$cat in | wc -c"
+done
+for cat in /bin/cat cat; do
+    measure file_to_file "$cat" "$cat in > out"
+done
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Compares two bench/run_bench.sh result files workload by workload.
+# usage: bench/compare.sh before.jsonl after.jsonl
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 before.jsonl after.jsonl" >&2
+    exit 1
+fi
+
+extract() {
+    # workload and its headline number (commands/s, or MB/s for the pipeline)
+    sed -n 's/.*"workload":"\([a-z]*\)".*"\(commands_per_sec\|mb_per_sec\)":\([0-9.]*\).*/\1 \2 \3/p' "$1"
+}
+
+extract "$1" > "$1.cmp.$$"
+extract "$2" | awk -v before="$1.cmp.$$" '
+    BEGIN { while ((getline line < before) > 0) { split(line, f, " "); old[f[1]] = f[3] } }
+    { change = old[$1] > 0 ? ($3 - old[$1]) / old[$1] * 100 : 0
+      printf "%-12s %-16s %12.1f -> %12.1f  (%+.1f%%)\n", $1, $2, old[$1], $3, change }'
+rm -f "$1.cmp.$$"
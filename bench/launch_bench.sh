@@ -0,0 +1,22 @@
+#!/bin/sh
+# Commands per second for the fork() launcher versus the posix_spawn launcher.
+# usage: bench/launch_bench.sh [number of commands] (run from the repo root after make)
+
+N=${1:-2000}
+SSHELL=${SSHELL:-./sshell}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+i=0
+while [ "$i" -lt "$N" ]; do
+    echo "/bin/true" # a path, not the true builtin, or nothing gets launched at all
+    i=$((i + 1))
+done > "$SCRIPT"
+
+for launcher in fork spawn; do
+    start=$(date +%s%N)
+    SSHELL_LAUNCHER=$launcher "$SSHELL" < "$SCRIPT" > /dev/null 2>&1
+    end=$(date +%s%N)
+    awk -v l="$launcher" -v n="$N" -v ns=$((end - start)) \
+        'BEGIN { printf "%-6s %d commands in %.3fs: %.0f commands/s\n", l, n, ns / 1e9, n / (ns / 1e9) }'
+done
@@ -0,0 +1,46 @@
+/* Parser microbenchmark: lines per second through parse_command_line().
+   Builds against the shell's own source so it measures exactly what the shell runs.
+   usage: bench/parser_bench [iterations] */
+
+#define main sshell_main
+#include "../sshell.c"
+#undef main
+
+#include <time.h>
+
+static const char *sample_lines[] = {
+    "ls",
+    "echo hello world",
+    "grep -n pattern file1.txt file2.txt file3.txt > matches.txt",
+    "cat < input.txt | sort | uniq -c | sort -rn | head -n 10 > top.txt",
+    "cmd1 arg1 arg2 | cmd2 arg1 | cmd3 | cmd4 | cmd5 arg1 arg2 arg3 &",
+    "   spaced    out    command   with   lots   of   blanks   ",
+    "echo>out.txt",
+    "a|b|c|d|e|f|g|h",
+    "diff <(sort a.txt) <(sort b.txt)",
+};
+
+int main(int argc, char *argv[]){
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    int num_samples = sizeof(sample_lines) / sizeof(sample_lines[0]);
+    struct Parser parser = { 0 };
+    struct CommandLine line;
+    long stages = 0;
+    load_settings(); //the argument limit comes from here
+    char *lines[num_samples]; //writable copies: the parser ends a process substitution in place while it reads it
+    for(int i = 0; i < num_samples; i++){
+        lines[i] = strdup(sample_lines[i]);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < iterations; i++){
+        stages += parse_command_line(lines[i % num_samples], &line, &parser); //each copy is left as it was
+        arena_reset(&parser.arena);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%ld lines (%ld stages) in %.3fs: %.0f lines/s\n", iterations, stages, seconds, iterations / seconds);
+    return 0;
+}
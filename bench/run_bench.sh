@@ -0,0 +1,82 @@
+#!/bin/sh
+# Workload benchmarks for sshell, fed through its non-tty stdin path.
+# Prints one JSON object per workload on stdout, so results from two commits can be compared
+# with bench/compare.sh. Per-command latencies come from an SSHELL_TRACE run of the same script.
+# usage: bench/run_bench.sh [commands per workload] (run from the repo root after make)
+
+N=${1:-2000}
+SSHELL=${SSHELL:-./sshell}
+PIPE_MB=${PIPE_MB:-512}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now() {
+    date +%s%N
+}
+
+repeat() {
+    # repeat <count> <line>...: writes the lines over and over, count lines in total
+    count=$1
+    shift
+    i=0
+    while [ "$i" -lt "$count" ]; do
+        for line in "$@"; do
+            [ "$i" -lt "$count" ] && echo "$line"
+            i=$((i + 1))
+        done
+    done
+}
+
+latencies() {
+    # per-command latency in microseconds: the gap between one parse_start and the next
+    grep '"event":"parse_start"' "$1" | sed 's/.*"ts_ns":\([0-9]*\).*/\1/' |
+        awk 'NR > 1 { printf "%.1f\n", ($1 - last) / 1000 } { last = $1 }' | sort -n > "$1.sorted"
+    awk '{ v[NR] = $1 } END {
+        if (NR == 0) { print "null null"; exit }
+        p50 = int(NR * 0.50); if (p50 < 1) p50 = 1
+        p99 = int(NR * 0.99); if (p99 < 1) p99 = 1
+        print v[p50], v[p99]
+    }' "$1.sorted"
+}
+
+run_workload() {
+    # run_workload <name> <script>: throughput from a plain run, latency from a traced one
+    name=$1
+    script=$2
+    commands=$(wc -l < "$script")
+
+    start=$(now)
+    (cd "$WORK" && "$OLDPWD/$SSHELL" < "$script" > /dev/null 2>&1)
+    end=$(now)
+
+    rm -f "$WORK/trace.jsonl"
+    (cd "$WORK" && SSHELL_TRACE="$WORK/trace.jsonl" "$OLDPWD/$SSHELL" < "$script" > /dev/null 2>&1)
+    set -- $(latencies "$WORK/trace.jsonl")
+
+    awk -v name="$name" -v n="$commands" -v ns=$((end - start)) -v p50="$1" -v p99="$2" 'BEGIN {
+        printf "{\"workload\":\"%s\",\"commands\":%d,\"seconds\":%.4f,\"commands_per_sec\":%.1f,\"p50_us\":%s,\"p99_us\":%s}\n",
+               name, n, ns / 1e9, n / (ns / 1e9), p50, p99
+    }'
+}
+
+repeat "$N" "/bin/true" > "$WORK/trivial.sh" # not the builtin: these two measure launching a process
+run_workload trivial "$WORK/trivial.sh"
+
+repeat $((N * 10)) "pwd" "cd /tmp" "pwd" "cd $WORK" > "$WORK/builtins.sh" # cheap, so more of them to get a stable number
+run_workload builtins "$WORK/builtins.sh"
+
+repeat "$N" "echo some text > out.txt" "cat < out.txt > copy.txt" "wc -c < copy.txt > count.txt" > "$WORK/redirection.sh"
+run_workload redirection "$WORK/redirection.sh"
+
+repeat "$N" "/bin/true &" > "$WORK/background.sh"
+echo "wait" >> "$WORK/background.sh"
+run_workload background "$WORK/background.sh"
+
+# one long pipeline pushing PIPE_MB megabytes through every stage
+echo "head -c ${PIPE_MB}M /dev/zero | cat | cat | cat | cat | cat | cat | wc -c" > "$WORK/pipeline.sh"
+start=$(now)
+"$SSHELL" < "$WORK/pipeline.sh" > /dev/null 2>&1
+end=$(now)
+awk -v mb="$PIPE_MB" -v ns=$((end - start)) 'BEGIN {
+    printf "{\"workload\":\"pipeline\",\"stages\":8,\"megabytes\":%d,\"seconds\":%.4f,\"mb_per_sec\":%.1f}\n", mb, ns / 1e9, mb / (ns / 1e9)
+}'
@@ -0,0 +1,95 @@
+#!/bin/sh
+# End-to-end check of sshell --serve / --connect: starts a server on a temporary socket, runs lines
+# through clients and compares their output and exit status with what the same lines give locally.
+# usage: bench/serve_check.sh (run from the repo root after make sshell); exits non-zero on a mismatch
+
+SSHELL=$(pwd)/sshell
+DIR=$(mktemp -d)
+SOCKET=$DIR/socket
+FAILED=0
+
+"$SSHELL" --serve "$SOCKET" 2> "$DIR/server.err" &
+SERVER=$!
+trap 'kill $SERVER 2> /dev/null; rm -rf "$DIR"' EXIT
+
+i=0
+while [ ! -S "$SOCKET" ]; do
+    i=$((i + 1))
+    if [ "$i" -gt 100 ]; then
+        echo "FAIL: server did not start" >&2
+        cat "$DIR/server.err" >&2
+        exit 1
+    fi
+    sleep 0.05
+done
+
+check() {
+    # check <name> <expected status> <expected stdout> <client arguments...>
+    name=$1
+    status=$2
+    expected=$3
+    shift 3
+    output=$("$SSHELL" --connect "$SOCKET" "$@" 2> /dev/null)
+    got=$?
+    if [ "$got" -ne "$status" ] || [ "$output" != "$expected" ]; then
+        echo "FAIL: $name: status $got (want $status), output '$output' (want '$expected')" >&2
+        FAILED=1
+    else
+        echo "ok: $name"
+    fi
+}
+
+check "echo" 0 "hello" -c "echo hello"
+check "external command" 0 "hello" -c "/bin/echo hello"
+check "pipeline" 0 "HELLO" -c "echo hello | /usr/bin/tr a-z A-Z"
+check "failing command" 1 "" -c "/bin/false"
+check "failing builtin" 1 "" -c "test 1 -eq 2"
+check "command not found" 127 "" -c "nosuchcommand"
+check "not executable" 126 "" -c "/etc/passwd"
+check "several lines" 0 "a
+b" -c "echo a
+echo b"
+printf 'echo x\n/bin/echo y\n' > "$DIR/lines"
+check "lines from stdin" 0 "x
+y" < "$DIR/lines"
+printf 'echo one\n/bin/echo two | /bin/cat\n' > "$DIR/script"
+check "script" 0 "one
+two" "$DIR/script"
+
+# the client's cwd, not the server's
+output=$(cd "$DIR" && "$SSHELL" --connect "$SOCKET" -c "/bin/ls script")
+if [ "$output" != "script" ]; then
+    echo "FAIL: relative path: output '$output' (want 'script')" >&2
+    FAILED=1
+else
+    echo "ok: relative path"
+fi
+
+# more clients at once than the server keeps spare sessions for
+BEFORE=$FAILED
+CLIENTS=
+j=0
+while [ "$j" -lt 20 ]; do
+    "$SSHELL" --connect "$SOCKET" -c "echo $j" > "$DIR/client.$j" &
+    CLIENTS="$CLIENTS $!"
+    j=$((j + 1))
+done
+for pid in $CLIENTS; do
+    wait "$pid"
+done
+j=0
+while [ "$j" -lt 20 ]; do
+    if [ "$(cat "$DIR/client.$j")" != "$j" ]; then
+        echo "FAIL: concurrent client $j: output '$(cat "$DIR/client.$j")'" >&2
+        FAILED=1
+    fi
+    j=$((j + 1))
+done
+[ "$FAILED" -ne "$BEFORE" ] || echo "ok: concurrent clients"
+
+if [ -s "$DIR/server.err" ]; then
+    echo "FAIL: server errors:" >&2
+    cat "$DIR/server.err" >&2
+    FAILED=1
+fi
+exit $FAILED
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Startup cost: microseconds per `SHELL -c LINE`, sshell (dynamic and static) against dash and bash.
+# Prints one JSON object per shell and line, like bench/run_bench.sh.
+# usage: bench/startup_bench.sh [runs] (run from the repo root after make sshell sshell-static)
+
+N=${1:-1000}
+
+measure() {
+    # measure <shell> <line>: runs the shell N times and keeps the time per run; best of three
+    best=0
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        i=0
+        while [ "$i" -lt "$N" ]; do
+            "$1" -c "$2" > /dev/null
+            i=$((i + 1))
+        done
+        end=$(date +%s%N)
+        ns=$((end - start))
+        if [ "$best" -eq 0 ] || [ "$ns" -lt "$best" ]; then
+            best=$ns
+        fi
+    done
+    awk -v shell="$1" -v line="$2" -v n="$N" -v ns="$best" 'BEGIN {
+        printf "{\"workload\":\"startup\",\"shell\":\"%s\",\"line\":\"%s\",\"runs\":%d,\"us_per_run\":%.1f}\n",
+               shell, line, n, ns / n / 1000
+    }'
+}
+
+for shell in ./sshell ./sshell-static /usr/bin/dash /usr/bin/bash; do
+    [ -x "$shell" ] || continue
+    measure "$shell" true
+    measure "$shell" "echo hi"
+done
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE //for pipe2 and F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,9 +6,36 @@
 #include <fcntl.h>  // for open(), O_WRONLY, O_CREAT
 #include <ctype.h> //help check for whitespace
 #include <stdbool.h> //for bools
+#include <stddef.h> //offsetof
 #include <sys/wait.h> //for waitpid
+#include <spawn.h> //for posix_spawnp and its file actions
+#include <errno.h> //to tell why a spawn failed
+#include <poll.h> //the meter relay waits on one side of its pipes at a time
+#include <sys/epoll.h> //one readiness set holding a pidfd per child
+#include <sys/pidfd.h> //for pidfd_open
+#include <limits.h> //for _POSIX_ARG_MAX
+#include <sys/stat.h> //to check PATH candidates are regular files
+#include <sys/resource.h> //struct rusage, filled in by wait4
+#include <sys/time.h> //timersub, for what an in-shell builtin used
+#include <time.h> //clock_gettime for wall time
+#include <signal.h> //SIGPIPE is ignored by the shell, builtins get EPIPE instead
+#include <pthread.h> //builtins inside a pipeline run on their own thread
+#include <sys/eventfd.h> //those threads say they're done through an eventfd in the epoll set
+#include <sys/signalfd.h> //signals arrive in the event loop like everything else
+#include <sys/sendfile.h> //the cat builtin copies in the kernel where it can
+#include <dirent.h> //to find the oldest entries of the memo cache, getdents64 for globs
+#include <fnmatch.h> //matches one path component of a glob
+#include <sys/mman.h> //memfd_create, parallel keeps each item's output in one until it's its turn
+#include <sched.h> //sched_setaffinity for @cpu=
+#include <sys/syscall.h> //set_mempolicy for @mem= has no libc wrapper
+#include <linux/mempolicy.h> //MPOL_BIND
+#include <sys/socket.h> //--serve: clients connect over a Unix socket and hand over their stdio
+#include <sys/un.h>
+#include <getopt.h> //getopt_long, for --serve and --connect
+#include <sys/file.h> //flock, sessions take turns appending to the history file
+#include <sys/prctl.h> //PR_SET_PDEATHSIG, a spare session goes away with its server
 
-#define CMDLINE_MAX 512
+extern char **environ; //handed to every spawned command
 
 #define MISSING_COMMAND "Error: missing command\n"
 #define NO_INPUT "Error: no input file\n"
@@ -16,600 +44,5341 @@
 #define MISLOCATED_OUTPUT "Error: mislocated output redirection\n"
 #define OUTPUT_UNOPENED "Error: cannot open output file\n"
 #define INPUT_UNOPENED "Error: cannot open input file\n"
+#define COMMAND_NOT_FOUND "Error: command not found\n"
+
+bool use_fork_launcher = false; //SSHELL_LAUNCHER=fork goes back to plain fork()+execvp (handy for benchmarking the two)
+int pipe_size = 0; //SSHELL_PIPE_SIZE, capacity asked for every pipeline pipe (0 keeps the kernel's 64 KiB)
+long argument_bytes_max = 0; //SSHELL_ARG_MAX, how much argv one command may carry (set in main from ARG_MAX)
+bool quiet = false; //-q, and always with -c: no completion lines, like a plain sh
+int last_status = 0; //exit code of the last foreground line, what -c and scripts exit with
+bool sh_statuses = false; //-c: a command that can't be started gives 127 (126 if it can't be executed) like sh, not 1
+int batch_size = 0; //-j N: how many script lines may run at once (0 runs them one after another)
+bool batch_unordered = false; //-u: report batch lines as they finish instead of in script order
+char memo_directory[PATH_MAX - 32]; //SSHELL_MEMO_DIR, where memo entries live (~/.cache/sshell/memo), short enough for the entry names
+long long memo_size_max = 64 * 1024 * 1024; //SSHELL_MEMO_SIZE, the least recently used entries go past this
+char *memo_environment = "PATH:LANG:LC_ALL"; //SSHELL_MEMO_ENV, variables that are part of a memo key
+char history_path[PATH_MAX]; //SSHELL_HISTORY, the history file (~/.local/state/sshell/history), empty for none
+long long history_size = 8 * 1024 * 1024; //SSHELL_HISTORY_SIZE, how big a new history file is made, the oldest lines go past it
+FILE *completions = NULL; //where completion lines go when not stderr: the client's socket under --serve
+
+enum TraceType {
+    TRACE_PARSE_START,
+    TRACE_PARSE_END,
+    TRACE_SPAWN, //about to start a child, detail is the command
+    TRACE_EXEC, //posix_spawn returned, so the child has already exec'd
+    TRACE_FORK, //fork launcher: the child has exec'd
+    TRACE_OPEN, //a redirection file was opened, detail is its name
+    TRACE_REAP, //a child was collected, detail is its exit code
+    TRACE_COMPLETE, //a whole job was reported, detail is its command line
+    TRACE_BUILTIN, //a stage ran in the shell instead of a child, detail is the builtin
+};
+
+const char *trace_names[] = { "parse_start", "parse_end", "spawn", "exec", "fork", "open", "reap", "complete", "builtin" };
+
+struct TraceEvent {
+    long long nanoseconds; //CLOCK_MONOTONIC
+    enum TraceType type;
+    pid_t pid; //the child it's about, 0 for the shell itself
+    char detail[48]; //truncated, so recording never allocates
+};
+
+#define TRACE_EVENTS 4096
+
+struct Trace {
+    bool enabled; //SSHELL_TRACE=<file> turns it on, everything else is skipped while this is false
+    bool chrome; //SSHELL_TRACE_FORMAT=chrome writes trace-event JSON instead of JSON Lines
+    FILE *file;
+    struct TraceEvent *events; //ring buffer, allocated once when tracing is turned on
+    long long head; //events recorded so far (the ring keeps the last TRACE_EVENTS of them)
+    long long flushed; //events already written out
+    pthread_mutex_t lock; //parallel's workers record their children too
+};
+
+struct Trace trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define TRACE(type, pid, detail) do { if(trace.enabled) trace_record(type, pid, detail); } while(0)
+
+void trace_record(enum TraceType type, pid_t pid, const char *detail){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&trace.lock);
+    struct TraceEvent *event = &trace.events[trace.head % TRACE_EVENTS];
+    event->nanoseconds = now.tv_sec * 1000000000LL + now.tv_nsec;
+    event->type = type;
+    event->pid = pid;
+    strncpy(event->detail, detail ? detail : "", sizeof(event->detail) - 1);
+    event->detail[sizeof(event->detail) - 1] = '\0';
+    trace.head++;
+    pthread_mutex_unlock(&trace.lock);
+}
+
+void trace_write_string(const char *string){
+    /* Writes a JSON string, escaping what needs it */
+    fputc('"', trace.file);
+    for(; *string != '\0'; string++){
+        unsigned char c = *string;
+        if(c == '"' || c == '\\'){
+            fprintf(trace.file, "\\%c", c);
+        }
+        else if(c < 0x20){
+            fprintf(trace.file, "\\u%04x", c);
+        }
+        else{
+            fputc(c, trace.file);
+        }
+    }
+    fputc('"', trace.file);
+}
+
+void trace_flush(void){
+    /* Writes out everything recorded since the last flush, called when a command completes and at exit */
+    if(!trace.enabled){
+        return;
+    }
+    pthread_mutex_lock(&trace.lock);
+    if(trace.head - trace.flushed > TRACE_EVENTS){ //the ring wrapped before we got here
+        long long dropped = trace.head - trace.flushed - TRACE_EVENTS;
+        if(trace.chrome){
+            fprintf(trace.file, "{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"g\",\"ts\":0,\"pid\":%d,\"tid\":0,\"args\":{\"events\":%lld}},\n", getpid(), dropped);
+        }
+        else{
+            fprintf(trace.file, "{\"event\":\"dropped\",\"count\":%lld}\n", dropped);
+        }
+        trace.flushed = trace.head - TRACE_EVENTS;
+    }
+
+    for(; trace.flushed < trace.head; trace.flushed++){
+        struct TraceEvent *event = &trace.events[trace.flushed % TRACE_EVENTS];
+        if(trace.chrome){
+            //children show up as their own rows, from exec to reap; everything else is an instant on the shell's row
+            const char *phase = event->type == TRACE_EXEC || event->type == TRACE_FORK ? "B" : event->type == TRACE_REAP ? "E" : "i";
+            fprintf(trace.file, "{\"name\":");
+            trace_write_string(phase[0] == 'i' ? trace_names[event->type] : event->type == TRACE_REAP ? "child" : event->detail);
+            fprintf(trace.file, ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"event\":\"%s\",\"detail\":", phase,
+                    event->nanoseconds / 1000.0, getpid(), event->pid, trace_names[event->type]);
+            trace_write_string(event->detail);
+            fprintf(trace.file, "}%s},\n", phase[0] == 'i' ? ",\"s\":\"t\"" : "");
+        }
+        else{
+            fprintf(trace.file, "{\"ts_ns\":%lld,\"event\":\"%s\",\"pid\":%d,\"detail\":", event->nanoseconds, trace_names[event->type], event->pid);
+            trace_write_string(event->detail);
+            fprintf(trace.file, "}\n");
+        }
+    }
+    fflush(trace.file);
+    pthread_mutex_unlock(&trace.lock);
+}
+
+void trace_start(const char *path, const char *format){
+    trace.file = fopen(path, "a");
+    if(trace.file == NULL){
+        fprintf(stderr, "Error: cannot open trace file\n");
+        return;
+    }
+    fcntl(fileno(trace.file), F_SETFD, FD_CLOEXEC); //children shouldn't inherit it
+    trace.chrome = (format != NULL && !strcmp(format, "chrome"));
+    if(trace.chrome && ftell(trace.file) == 0){
+        fprintf(trace.file, "[\n"); //the viewer accepts the array without its closing bracket
+    }
+    trace.events = calloc(TRACE_EVENTS, sizeof(struct TraceEvent));
+    trace.enabled = true;
+    atexit(trace_flush);
+}
+
+/* Session statistics, always on: per command name (arguments[0] of every child), HDR-style histograms
+   of how long the spawn took, how long it ran and how long its exit waited for the shell, and counts
+   of what went wrong. A histogram bucket is a power of two split in 16, so every value is kept within
+   6%. Recording is a few relaxed atomic adds into a fixed table, never a lock or a malloc, since the
+   parallel builtin's workers launch commands too. stats shows them, stats reset zeroes them */
+#define STATS_COMMANDS 64 //names past this many are counted under (other)
+#define STATS_NAME 32 //longer names are cut
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS 608 //up to 2^40 ns (18 minutes), longer goes in the last bucket
+
+enum StatsTimer {
+    STATS_SPAWN, //fork/posix_spawn until it returned (posix_spawn returns once the exec is done)
+    STATS_RUNTIME, //launch until reaped
+    STATS_REAP, //exit until reaped, at most: the exit is known to be after the event loop last looked
+    STATS_TIMERS
+};
+
+const char *stats_timer_names[STATS_TIMERS] = { "spawn", "runtime", "reap" };
+
+struct Histogram {
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+};
+
+struct CommandStats {
+    unsigned long hash; //0 while the slot is free, taken with a compare-and-swap
+    int ready; //the name is written
+    char name[STATS_NAME];
+    unsigned long long runs;
+    unsigned long long fork_failures; //fork or posix_spawn couldn't make a process
+    unsigned long long exec_failures; //Error: command not found
+    unsigned long long nonzero_exits;
+    struct Histogram timers[STATS_TIMERS];
+};
+
+struct CommandStats command_stats[STATS_COMMANDS];
+struct CommandStats other_stats = { .hash = 1, .ready = 1, .name = "(other)" };
+
+long long monotonic_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+unsigned long string_hash(const char *string);
+
+struct CommandStats *stats_for(const char *name){
+    /* The slot of a command name, taking a free one the first time */
+    unsigned long hash = string_hash(name) | 1; //never 0
+    for(int probe = 0; probe < STATS_COMMANDS; probe++){
+        struct CommandStats *stats = &command_stats[(hash + probe) % STATS_COMMANDS];
+        unsigned long seen = __atomic_load_n(&stats->hash, __ATOMIC_ACQUIRE);
+        if(seen == 0){
+            if(__atomic_compare_exchange_n(&stats->hash, &seen, hash, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                snprintf(stats->name, STATS_NAME, "%s", name);
+                __atomic_store_n(&stats->ready, 1, __ATOMIC_RELEASE);
+                return stats;
+            }
+        }
+        if(seen != hash){
+            continue; //someone else's, or another thread just took it for another name
+        }
+        while(!__atomic_load_n(&stats->ready, __ATOMIC_ACQUIRE)){
+            continue; //the thread that took it is writing the name
+        }
+        if(!strncmp(stats->name, name, STATS_NAME - 1)){
+            return stats;
+        }
+    }
+    return &other_stats;
+}
+
+int histogram_bucket(unsigned long long value){
+    /* Values under 32 have a bucket each, above that the top 5 bits decide */
+    if(value < (2 << HISTOGRAM_SUB_BITS)){
+        return value;
+    }
+    int top = 63 - __builtin_clzll(value);
+    int shift = top - HISTOGRAM_SUB_BITS;
+    int bucket = shift * (1 << HISTOGRAM_SUB_BITS) + (value >> shift);
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+unsigned long long histogram_value(int bucket){
+    /* The middle of what falls in bucket */
+    if(bucket < (2 << HISTOGRAM_SUB_BITS)){
+        return bucket;
+    }
+    int shift = bucket / (1 << HISTOGRAM_SUB_BITS) - 1;
+    unsigned long long low = (unsigned long long)(bucket % (1 << HISTOGRAM_SUB_BITS) + (1 << HISTOGRAM_SUB_BITS)) << shift;
+    return low + (1ULL << shift) / 2;
+}
+
+void stats_time(struct CommandStats *stats, enum StatsTimer timer, long long nanoseconds){
+    struct Histogram *histogram = &stats->timers[timer];
+    unsigned long long value = nanoseconds > 0 ? nanoseconds : 0;
+    __atomic_fetch_add(&histogram->counts[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total, 1, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while(value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        continue; //max was reloaded, try again if still bigger
+    }
+}
+
+void stats_count(unsigned long long *counter){
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+struct Placement { //where a stage may run, from its @cpu= and @mem= words
+    bool automatic; //@cpu=auto, the cpus are picked by pipeline
+    bool has_cpus;
+    cpu_set_t cpus;
+    int memory_node; //@mem=N binds its memory to NUMA node N, -1 leaves the default policy
+};
 
 struct Command {
-    char sub_command[CMDLINE_MAX]; //will hold the full command line for each command (used for tokenization)
-    char *arguments[16]; //the command name is arguments[0]
-    char output[32]; //if output redirection is needed (max token size is 32)
-    char input[32]; //if input redirection is needed
-    int read_fd;
+    char **arguments; //the command name is arguments[0], NULL-terminated (points into the parser's arena)
+    int num_arguments;
+    struct Placement *placement; //NULL if the stage has no @ words
+    char *output; //if output redirection is needed (NULL if not)
+    char *input; //if input redirection is needed
+    bool here_string; //<<< word: input is the text itself, not a file name
+    int read_fd; //-1 until the input file is opened
     int write_fd;
     pid_t pid; //pid provided by the child when the command is executed
-    bool need_background_command; //will become true if there is an ambersand attached && it's the last command
 };
 
-struct Background {
-    pid_t pids[4]; //up to 4 pids if the background process is a pipeline
-    int exit_codes[4];
-    char command_string[CMDLINE_MAX]; //this holds the string of what the background process is
-    int background_commands; //to keep track of how many commands are part of the background process
-    bool currently_executing; //true if yes false if no
-    int completed_processes;
+struct Meter { //the relay on one pipe of a metered pipeline, between stage i and i + 1
+    pthread_t thread;
+    bool running; //false if the line failed before this pipe was made, so there is no thread to join
+    int in_fd; //read end of the pipe stage i writes into
+    int out_fd; //write end of the pipe stage i + 1 reads from
+    long long bytes;
+    long long started; //ns, CLOCK_MONOTONIC
+    long long ended;
+    long long starved; //ns spent waiting for stage i to write something (stage i is the slow one)
+    long long blocked; //ns spent waiting for stage i + 1 to make room (stage i + 1 is the slow one)
+};
+
+struct Job {
+    int id; //job number, what jobs and wait refer to
+    pid_t *pids; //one per stage of the pipeline, -1 once that stage is done
+    int *exit_codes;
+    int num_stages;
+    int num_substitutions; //<(...) and >(...) commands, waited for as stages past num_stages but not reported
+    int *substitution_fds; //the shell's end of each one's pipe, kept until the stage naming it no longer needs it
+    int *substitution_users; //that stage, if it's a builtin on a thread (it opens /dev/fd/N late), -1 otherwise
+    int completed_processes; //how many stages have been reaped so far
+    char *command_string; //this holds the string of what the job is
+    bool background;
+    bool batch; //a script line running alongside others under -j, reported like a foreground job but not waited for
+    bool timed; //started with the time prefix, report the usage of every stage
+    struct Meter *meters; //started with the meter prefix: one per pipe, NULL otherwise
+    struct Memo *memo; //started with the memo prefix and not found in the cache: store it when done
+    struct timespec *started; //per stage: when it was launched, when it was reaped, and what it used
+    struct timespec *ended;
+    struct rusage *usages;
+    struct CommandStats **stats; //per stage, where its runtime goes once reaped, NULL for builtins
+    struct Job *next_finished; //link in the queue of finished jobs that haven't been reported yet
+    struct Job *next_batch; //link in the list of batch jobs, in script order
+};
+
+struct BuiltinStage;
+
+struct PidSlot {
+    pid_t pid; //0 if the slot was never used, -1 if its job went away
+    int pidfd; //becomes readable when the child exits, -1 if the kernel couldn't give us one
+    int stage;
+    struct Job *job;
+};
+
+struct JobTable {
+    struct Job **slots; //slot i holds job id i + 1 (NULL if free)
+    int capacity;
+    int *free_slots; //min-heap of slots that can be handed out again, so the lowest free id is reused first
+    int num_free;
+    int next_unused; //slots past this one have never been handed out
+    int running; //background jobs that still have stages running
+
+    int epoll_fd; //pidfds of every child we're waiting on, tagged with their pid
+    int unwatched; //children without a pidfd, those get collected by polling waitpid
+    long long looked; //when the event loop last returned, children it finds done now exited after that
+    long long exited_after; //for the reap delay of the children being collected
+
+    struct PidSlot *pid_map; //open addressing, pid -> (job, stage)
+    int map_capacity; //always a power of 2
+    int map_used; //live entries and deleted markers, both lengthen probes
+
+    int builtin_event_fd; //in the epoll set as pid 0, bumped by a builtin thread when it is done
+    pthread_mutex_t builtin_lock; //guards builtin_done, the only thing the threads touch
+    struct BuiltinStage *builtin_done; //finished builtin stages the main thread hasn't credited yet
+    int builtin_threads; //started and not credited yet, while any runs nothing environ had can be freed
+
+    /* The rest of the event loop: the same epoll set also has stdin and a signalfd in it */
+    struct LineReader *reader; //where stdin goes when it's readable
+    bool stdin_pollable; //false for a regular file, which epoll refuses (and which never blocks)
+    bool stdin_watched; //off while a foreground job reads the shell's stdin, at EOF, or past TYPEAHEAD_MAX
+    bool at_prompt; //waiting for a command line, not for a job
+    int signal_fd; //SIGINT/SIGQUIT when interactive, SIGCHLD when some child has no pidfd, -1 if neither
+    sigset_t signals; //what signal_fd is for, all blocked
+    int null_fd; //stdin of background and batch jobs, opened when first needed
+
+    struct Job *finished_head; //background jobs that are done but not reported, oldest first
+    struct Job *finished_tail;
+
+    int batch_running; //batch jobs that still have stages running
+    struct Job *batch_head; //batch jobs not reported yet, in the order the script gave them
+    struct Job *batch_tail;
+};
+
+struct LineReader {
+    int fd; //where the commands come from: stdin, a script file, or -1 when -c put them all in the buffer
+    char *buffer; //what has been read from stdin but not handed out yet, grows to fit the longest line
+    size_t capacity;
+    size_t start;
+    size_t end;
+    char *line; //the line handed out last, NUL-terminated
+    size_t line_capacity;
+    bool eof;
+};
+
+#define PROMPT "sshell@ucd$ "
+#define TYPEAHEAD_MAX (64 * 1024) //stop reading stdin ahead of the commands once this much is waiting
+
+void reader_fill(struct LineReader *reader){
+    /* One read() of the commands into the buffer, making room first */
+    size_t available = reader->end - reader->start;
+    if(reader->start > 0){
+        memmove(reader->buffer, reader->buffer + reader->start, available); //make room at the end
+        reader->start = 0;
+        reader->end = available;
+    }
+    if(reader->end == reader->capacity){ //the line is longer than the buffer, double it
+        reader->capacity = reader->capacity ? reader->capacity * 2 : 4096;
+        reader->buffer = realloc(reader->buffer, reader->capacity);
+    }
+    ssize_t n = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end);
+    if(n > 0){
+        reader->end += n;
+    }
+    else if(n == 0 || errno != EINTR){
+        reader->eof = true;
+    }
+}
+
+void job_table_init(struct JobTable *table){
+    memset(table, 0, sizeof(*table));
+    table->map_capacity = 64;
+    table->pid_map = calloc(table->map_capacity, sizeof(struct PidSlot));
+    table->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    table->builtin_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = 0 }; //no child ever has pid 0
+    epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, table->builtin_event_fd, &event);
+    pthread_mutex_init(&table->builtin_lock, NULL);
+
+    table->signal_fd = -1;
+    table->null_fd = -1;
+    sigemptyset(&table->signals);
+}
+
+/* ^C and ^\ while a foreground job runs reach the shell through signal_fd. Its children get them from
+   the terminal as well, its builtin stages (on threads) poll interrupt_fd, which the event loop makes
+   readable then, and stop with INTERRUPTED */
+#define INTERRUPTED 130 //128 + SIGINT, what sh gives a command stopped by ^C
+
+int interrupt_fd = -1; //eventfd, only when interactive
+__thread bool interruptible = false; //this thread runs a builtin of the foreground job
+
+bool interrupt_pending(void){
+    struct pollfd fd = { .fd = interrupt_fd, .events = POLLIN };
+    return interruptible && poll(&fd, 1, 0) > 0;
+}
+
+void interrupt_clear(void){
+    /* A new foreground job starts, a ^C from before isn't for it */
+    uint64_t count;
+    if(interrupt_fd >= 0 && read(interrupt_fd, &count, sizeof(count)) < 0){
+        //there was none
+    }
+}
+
+bool wait_readable(int fd){
+    /* Blocks until fd can be read, false if the foreground job gets interrupted first */
+    if(!interruptible){
+        return true;
+    }
+    struct pollfd fds[2] = { { .fd = fd, .events = POLLIN }, { .fd = interrupt_fd, .events = POLLIN } };
+    while(poll(fds, 2, -1) < 0 && errno == EINTR){
+    }
+    return !(fds[1].revents & POLLIN);
+}
+
+#define EVENT_STDIN (1ULL << 32) //epoll tags: children are tagged with their pid (which fits in 32 bits)
+#define EVENT_SIGNAL (2ULL << 32) //and the builtin eventfd with 0
+
+void watch_signal(struct JobTable *table, int signal){
+    /* Blocks signal and delivers it through the event loop instead */
+    sigaddset(&table->signals, signal);
+    pthread_sigmask(SIG_BLOCK, &table->signals, NULL); //threads started later inherit it, children get it cleared
+    bool new = table->signal_fd < 0;
+    table->signal_fd = signalfd(table->signal_fd, &table->signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    if(new && table->signal_fd >= 0){
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_SIGNAL };
+        epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, table->signal_fd, &event);
+    }
+}
+
+void watch_stdin(struct JobTable *table, bool on){
+    /* Turns reading stdin in the event loop on or off */
+    struct LineReader *reader = table->reader;
+    on = on && !reader->eof && reader->end - reader->start < TYPEAHEAD_MAX;
+    if(!table->stdin_pollable || on == table->stdin_watched){
+        return;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_STDIN };
+    epoll_ctl(table->epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, reader->fd, &event); //taken out, not just masked,
+    table->stdin_watched = on;                                                           //a hangup is reported regardless
+}
+
+void event_loop_init(struct JobTable *table, struct LineReader *reader){
+    /* Puts the command input (stdin, or the script file) into the epoll set next to the children, and when interactive takes ^C and ^\ as events,
+       they are meant for the foreground job (which gets them from the terminal anyway), not the shell */
+    table->reader = reader;
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_STDIN };
+    table->stdin_pollable = reader->fd >= 0 && epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, reader->fd, &event) == 0;
+    table->stdin_watched = table->stdin_pollable;
+    if(isatty(reader->fd)){
+        watch_signal(table, SIGINT);
+        watch_signal(table, SIGQUIT);
+        interrupt_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+}
+
+unsigned int pid_hash(pid_t pid, int map_capacity){
+    return ((unsigned int)pid * 2654435761u) & (map_capacity - 1); //Knuth's multiplicative hash
+}
+
+void pid_map_put(struct JobTable *table, pid_t pid, int pidfd, struct Job *job, int stage);
+
+void pid_map_grow(struct JobTable *table){
+    struct PidSlot *old_map = table->pid_map;
+    int old_capacity = table->map_capacity;
+
+    int live = 0;
+    for(int i = 0; i < old_capacity; i++){
+        if(old_map[i].pid > 0){
+            live++;
+        }
+    }
+    table->map_capacity = 64;
+    while(table->map_capacity < live * 4){ //a quarter full after the rehash, deleted markers are swept out too
+        table->map_capacity *= 2;
+    }
+
+    table->pid_map = calloc(table->map_capacity, sizeof(struct PidSlot));
+    table->map_used = 0;
+    for(int i = 0; i < old_capacity; i++){
+        if(old_map[i].pid > 0){
+            pid_map_put(table, old_map[i].pid, old_map[i].pidfd, old_map[i].job, old_map[i].stage);
+        }
+    }
+    free(old_map);
+}
+
+void pid_map_put(struct JobTable *table, pid_t pid, int pidfd, struct Job *job, int stage){
+    if((table->map_used + 1) * 2 > table->map_capacity){ //keep the load under half so probes stay short
+        pid_map_grow(table);
+    }
+    unsigned int i = pid_hash(pid, table->map_capacity);
+    while(table->pid_map[i].pid > 0){
+        i = (i + 1) & (table->map_capacity - 1);
+    }
+    if(table->pid_map[i].pid == 0){
+        table->map_used++; //reusing a deleted marker doesn't add to the probe lengths
+    }
+    table->pid_map[i].pid = pid;
+    table->pid_map[i].pidfd = pidfd;
+    table->pid_map[i].job = job;
+    table->pid_map[i].stage = stage;
+}
+
+struct PidSlot *pid_map_find(struct JobTable *table, pid_t pid){
+    unsigned int i = pid_hash(pid, table->map_capacity);
+    while(table->pid_map[i].pid != 0){
+        if(table->pid_map[i].pid == pid){
+            return &table->pid_map[i];
+        }
+        i = (i + 1) & (table->map_capacity - 1);
+    }
+    return NULL;
+}
+
+void free_slot_push(struct JobTable *table, int slot){
+    int i = table->num_free++;
+    while(i > 0 && table->free_slots[(i - 1) / 2] > slot){ //sift up
+        table->free_slots[i] = table->free_slots[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    table->free_slots[i] = slot;
+}
+
+int free_slot_pop(struct JobTable *table){
+    int lowest = table->free_slots[0];
+    int last = table->free_slots[--table->num_free];
+    int i = 0;
+    while(2 * i + 1 < table->num_free){ //sift down
+        int child = 2 * i + 1;
+        if(child + 1 < table->num_free && table->free_slots[child + 1] < table->free_slots[child]){
+            child++;
+        }
+        if(table->free_slots[child] >= last){
+            break;
+        }
+        table->free_slots[i] = table->free_slots[child];
+        i = child;
+    }
+    table->free_slots[i] = last;
+    return lowest;
+}
+
+struct Job *job_create(struct JobTable *table, char *cmd_copy, int num_stages, bool background){
+    /* Allocates a job with room for every stage, and gives it the lowest id that is free */
+    struct Job *job = malloc(sizeof(struct Job));
+    job->pids = malloc(num_stages * sizeof(pid_t));
+    job->exit_codes = malloc(num_stages * sizeof(int));
+    job->started = calloc(num_stages, sizeof(struct timespec));
+    job->ended = calloc(num_stages, sizeof(struct timespec));
+    job->usages = calloc(num_stages, sizeof(struct rusage)); //stays zero for stages that never started
+    job->stats = calloc(num_stages, sizeof(struct CommandStats *));
+    job->timed = false;
+    job->meters = NULL;
+    job->memo = NULL;
+    job->num_stages = num_stages;
+    job->num_substitutions = 0;
+    job->substitution_fds = NULL;
+    job->substitution_users = NULL;
+    job->completed_processes = 0;
+    job->command_string = strdup(cmd_copy);
+    job->background = background;
+    job->batch = false;
+    job->next_finished = NULL;
+    job->next_batch = NULL;
+
+    int slot;
+    if(table->num_free > 0){
+        slot = free_slot_pop(table);
+    }
+    else{
+        if(table->next_unused == table->capacity){ //out of slots, double the table
+            table->capacity = table->capacity ? table->capacity * 2 : 16;
+            table->slots = realloc(table->slots, table->capacity * sizeof(struct Job *));
+            table->free_slots = realloc(table->free_slots, table->capacity * sizeof(int));
+        }
+        slot = table->next_unused++;
+    }
+    table->slots[slot] = job;
+    job->id = slot + 1;
+
+    if(background){
+        table->running++;
+    }
+    return job;
+}
+
+bool job_finished(struct Job *job){
+    return job->completed_processes == job->num_stages + job->num_substitutions;
+}
+
+void job_stage_done(struct JobTable *table, struct Job *job, int stage, int exit_code){
+    clock_gettime(CLOCK_MONOTONIC, &job->ended[stage]);
+    job->pids[stage] = -1; //mark as finished
+    job->exit_codes[stage] = exit_code;
+    job->completed_processes++;
+    for(int i = 0; i < job->num_substitutions; i++){
+        if(job->substitution_users[i] == stage && job->substitution_fds[i] >= 0){
+            close(job->substitution_fds[i]); //the builtin is done with /dev/fd/N, now the other side sees EOF or EPIPE
+            job->substitution_fds[i] = -1;
+        }
+    }
+
+    if(!job_finished(job)){
+        return;
+    }
+    if(job->batch){
+        table->batch_running--;
+        if(!batch_unordered){
+            return; //stays in the batch list until every line before it has been reported
+        }
+    }
+    else if(job->background){
+        table->running--;
+    }
+    else{
+        return; //foreground, whoever is waiting for it reports it
+    }
+
+    //all commands are ready, queue it to be reported
+    if(table->finished_tail != NULL){
+        table->finished_tail->next_finished = job;
+    }
+    else{
+        table->finished_head = job;
+    }
+    table->finished_tail = job;
+}
+
+void job_add_batch(struct JobTable *table, struct Job *job){
+    /* Marks a job as a batch line and puts it at the end of the script-order list */
+    job->batch = true;
+    table->batch_running++;
+    if(batch_unordered){
+        return; //reported through the finished queue instead
+    }
+    if(table->batch_tail != NULL){
+        table->batch_tail->next_batch = job;
+    }
+    else{
+        table->batch_head = job;
+    }
+    table->batch_tail = job;
+}
+
+int launch_status(int error){
+    /* The exit code of a command that couldn't be started, from the errno launch_command left */
+    if(!sh_statuses || error == EAGAIN || error == ENOMEM || error == EMFILE || error == ENFILE){ //out of something, not the command's fault
+        return 1;
+    }
+    return error == ENOENT || error == ENOTDIR ? 127 : 126;
+}
+
+void job_add_pid(struct JobTable *table, struct Job *job, int stage, pid_t pid){
+    /* Records the pid of one stage so the reaper can find it again. Right after launch_command, so a
+       -1 still has its errno */
+    job->pids[stage] = pid;
+    if(pid < 0){ //never started, so it is already done
+        job_stage_done(table, job, stage, launch_status(errno));
+        return;
+    }
+
+    /* A pidfd turns readable once the child exits, so the epoll set tells us exactly which child to collect */
+    int pidfd = pidfd_open(pid, 0);
+    if(pidfd >= 0){
+        fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = (unsigned int)pid };
+        epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, pidfd, &event);
+    }
+    else{
+        if(table->unwatched++ == 0 && !sigismember(&table->signals, SIGCHLD)){ //kernel without pidfds (before 5.3)
+            watch_signal(table, SIGCHLD); //then SIGCHLD says when to look
+        }
+    }
+    pid_map_put(table, pid, pidfd, job, stage);
+}
+
+void job_free(struct JobTable *table, struct Job *job){
+    table->slots[job->id - 1] = NULL;
+    free_slot_push(table, job->id - 1);
+    free(job->command_string);
+    free(job->pids);
+    free(job->exit_codes);
+    free(job->started);
+    free(job->ended);
+    free(job->usages);
+    free(job->stats);
+    free(job->meters);
+    for(int i = 0; i < job->num_substitutions; i++){
+        if(job->substitution_fds[i] >= 0){
+            close(job->substitution_fds[i]);
+        }
+    }
+    free(job->substitution_fds);
+    free(job->substitution_users);
+    free(job);
+}
+
+void collect_child(struct JobTable *table, struct PidSlot *slot, int status, struct rusage *usage){
+    /* Credits an exited child to its job/stage and forgets it */
+    struct Job *job = slot->job;
+    int stage = slot->stage;
+    job->usages[stage] = *usage;
+    struct CommandStats *stats = job->stats[stage];
+    if(stats != NULL){
+        long long now = monotonic_ns();
+        long long started = job->started[stage].tv_sec * 1000000000LL + job->started[stage].tv_nsec;
+        stats_time(stats, STATS_RUNTIME, now - started);
+        stats_time(stats, STATS_REAP, now - (table->exited_after > started ? table->exited_after : started));
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            stats_count(&stats->nonzero_exits);
+        }
+    }
+    if(trace.enabled){
+        char exit_code[16];
+        snprintf(exit_code, sizeof(exit_code), "%d", WEXITSTATUS(status));
+        trace_record(TRACE_REAP, slot->pid, exit_code);
+    }
+    if(slot->pidfd >= 0){
+        close(slot->pidfd); //also takes it out of the epoll set
+    }
+    else{
+        table->unwatched--;
+    }
+    slot->pid = -1; //leave a deleted marker so later probes keep going
+    job_stage_done(table, job, stage, WEXITSTATUS(status));
+}
+
+struct Builtin;
+
+struct BuiltinStage { //a builtin running on its own thread as one stage of a job
+    const struct Builtin *builtin;
+    char **arguments; //its own copy, the line's arena is reset before the thread is done
+    int in_fd; //owned by the thread and closed when it's done, so the next stage sees EOF
+    int out_fd;
+    struct JobTable *table;
+    struct Job *job; //only touched by the main thread
+    int stage;
+    int exit_code;
+    struct rusage usage;
+    bool interruptible; //a stage of the foreground job, stopped by ^C
+    struct BuiltinStage *next_done;
+};
+
+int collect_builtins(struct JobTable *table){
+    /* Credits every builtin thread that finished to its job/stage, returns how many */
+    uint64_t count;
+    if(read(table->builtin_event_fd, &count, sizeof(count)) < 0){
+        return 0; //nothing new
+    }
+
+    pthread_mutex_lock(&table->builtin_lock);
+    struct BuiltinStage *done = table->builtin_done;
+    table->builtin_done = NULL;
+    pthread_mutex_unlock(&table->builtin_lock);
+
+    int collected = 0;
+    while(done != NULL){
+        struct BuiltinStage *stage = done;
+        done = stage->next_done;
+        stage->job->usages[stage->stage] = stage->usage;
+        job_stage_done(table, stage->job, stage->stage, stage->exit_code);
+        free(stage->arguments);
+        free(stage);
+        table->builtin_threads--;
+        collected++;
+    }
+    return collected;
+}
+
+void handle_signals(struct JobTable *table){
+    struct signalfd_siginfo info;
+    while(read(table->signal_fd, &info, sizeof(info)) == sizeof(info)){
+        if((info.ssi_signo == SIGINT || info.ssi_signo == SIGQUIT) && table->at_prompt){
+            printf("\n" PROMPT); //the terminal dropped the half typed line, start over
+            fflush(stdout);
+        }
+        else if(info.ssi_signo == SIGINT || info.ssi_signo == SIGQUIT){
+            uint64_t one = 1; //for the foreground job's builtins, its children got the signal from the terminal
+            if(write(interrupt_fd, &one, sizeof(one)) < 0){
+                //can only fail if the counter overflows
+            }
+        }
+        //SIGCHLD is handled by the caller
+    }
+}
+
+int handle_events(struct JobTable *table, int timeout){
+    /* The event loop: waits up to timeout ms (-1 forever) for anything in the epoll set, then handles all
+       of it: collects the children and builtin threads that finished, reads stdin into the line reader
+       and takes signals. Returns how many stages were collected */
+    struct epoll_event events[64];
+    int collected = 0;
+
+    /* Whatever is ready without waiting happened since the last look; if it has to wait, what wakes it
+       just happened. That's all the reap delay in stats can know about when a child exited */
+    table->exited_after = table->looked;
+    int ready = epoll_wait(table->epoll_fd, events, 64, 0);
+    if(ready == 0 && timeout != 0){
+        ready = epoll_wait(table->epoll_fd, events, 64, timeout);
+        table->exited_after = monotonic_ns();
+    }
+    table->looked = monotonic_ns();
+    for(int i = 0; i < ready; i++){
+        if(events[i].data.u64 == 0){ //not a child, builtin threads finished
+            collected += collect_builtins(table);
+            continue;
+        }
+        if(events[i].data.u64 == EVENT_STDIN){
+            reader_fill(table->reader); //typeahead, read_command_line finds it there
+            watch_stdin(table, true); //off again at EOF or when enough is waiting
+            continue;
+        }
+        if(events[i].data.u64 == EVENT_SIGNAL){
+            handle_signals(table);
+            continue;
+        }
+        pid_t pid = (pid_t)events[i].data.u64;
+        struct PidSlot *slot = pid_map_find(table, pid);
+        int status;
+        struct rusage usage;
+        if(slot != NULL && wait4(pid, &status, WNOHANG, &usage) == pid){ //wait4 also hands back what the child used
+            collect_child(table, slot, status, &usage);
+            collected++;
+        }
+    }
+
+    if(table->unwatched > 0){ //only our own pids, not wait4(-1): parallel's workers wait for their children themselves
+        for(int i = 0; i < table->map_capacity; i++){
+            struct PidSlot *slot = &table->pid_map[i];
+            int status;
+            struct rusage usage;
+            if(slot->pid > 0 && slot->pidfd < 0 && wait4(slot->pid, &status, WNOHANG, &usage) == slot->pid){
+                collect_child(table, slot, status, &usage);
+                collected++;
+            }
+        }
+    }
+    return collected;
+}
+
+void *meter_relay(void *data){
+    /* Moves everything from one pipe to the next with splice, so the data is never copied, and keeps
+       track of which side it was waiting on. It only splices once poll said the input has data, so a
+       splice that would block means the output pipe is full */
+    struct Meter *meter = data;
+    meter->started = monotonic_ns();
+    while(1){
+        struct pollfd input = { .fd = meter->in_fd, .events = POLLIN };
+        long long before = monotonic_ns();
+        if(poll(&input, 1, -1) < 0){
+            continue; //EINTR
+        }
+        meter->starved += monotonic_ns() - before;
+
+        ssize_t n = splice(meter->in_fd, NULL, meter->out_fd, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0){
+            meter->bytes += n;
+            continue;
+        }
+        if(n == 0){
+            break; //stage i closed its end
+        }
+        if(errno == EAGAIN){
+            struct pollfd output = { .fd = meter->out_fd, .events = POLLOUT };
+            before = monotonic_ns();
+            poll(&output, 1, -1);
+            meter->blocked += monotonic_ns() - before;
+            continue; //POLLERR when stage i + 1 is gone shows up as EPIPE on the next splice
+        }
+        if(errno != EINTR){
+            break; //EPIPE: stage i + 1 exited, closing our input gives stage i its SIGPIPE too
+        }
+    }
+    meter->ended = monotonic_ns();
+    close(meter->in_fd);
+    close(meter->out_fd);
+    return NULL;
+}
+
+void memo_finish(struct Job *job);
+
+void print_completion(char *command_string, int *exit_codes, int num_stages){
+    if(quiet){
+        return;
+    }
+    FILE *out = completions != NULL ? completions : stderr;
+    fprintf(out, "+ completed '%s' ", command_string);
+    for(int i = 0; i < num_stages; i++){
+        fprintf(out, "[%d]", exit_codes[i]); //print all the exit codes
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+double seconds(struct timeval time){
+    return time.tv_sec + time.tv_usec / 1e6;
+}
+
+void report_job(struct Job *job){
+    /* The completion line, for timed jobs what each stage used, in the same [..] per stage form, and for
+       metered jobs what went through each pipe: bytes, MB/s, and how long the relay waited on the stage
+       before the pipe (starved) and after it (blocked). The stage next to the biggest wait is the slow one */
+    if(job->memo != NULL){
+        memo_finish(job); //its output was held back in the cache
+    }
+    print_completion(job->command_string, job->exit_codes, job->num_stages);
+    if(!job->background){
+        last_status = job->exit_codes[job->num_stages - 1];
+    }
+    if(trace.enabled){
+        trace_record(TRACE_COMPLETE, 0, job->command_string);
+        trace_flush();
+    }
+    if(job->meters != NULL){
+        fprintf(stderr, "+ meter '%s' ", job->command_string);
+        for(int i = 0; i < job->num_stages - 1; i++){
+            struct Meter *meter = &job->meters[i];
+            if(!meter->running){
+                continue;
+            }
+            pthread_join(meter->thread, NULL); //every stage is done, so both of its pipes are closed and it's stopping
+            double wall = (meter->ended - meter->started) / 1e9;
+            double megabytes = meter->bytes / 1e6;
+            fprintf(stderr, "[%d>%d %.1fMB %.1fMB/s starved %.3fs blocked %.3fs]", i + 1, i + 2, megabytes,
+                    wall > 0 ? megabytes / wall : 0, meter->starved / 1e9, meter->blocked / 1e9);
+        }
+        fprintf(stderr, "\n");
+    }
+    if(!job->timed){
+        return;
+    }
+    fprintf(stderr, "+ time '%s' ", job->command_string);
+    for(int i = 0; i < job->num_stages; i++){
+        struct rusage *usage = &job->usages[i];
+        double wall = (job->ended[i].tv_sec - job->started[i].tv_sec) + (job->ended[i].tv_nsec - job->started[i].tv_nsec) / 1e9;
+        fprintf(stderr, "[%.3fr %.3fu %.3fs %ldk %ldv %ldi]", wall, seconds(usage->ru_utime), seconds(usage->ru_stime),
+                usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw); //wall/user/sys time, max RSS, voluntary/involuntary switches
+    }
+    fprintf(stderr, "\n");
+}
+
+int report_finished_jobs(struct JobTable *table){
+    /* Prints every background job that finished since the last call. Only looks at the finished ones */
+    int reported = 0;
+    while(table->finished_head != NULL){
+        struct Job *job = table->finished_head;
+        table->finished_head = job->next_finished;
+        report_job(job);
+        job_free(table, job);
+        reported++;
+    }
+    table->finished_tail = NULL;
+
+    /* Batch lines in script order: a finished line waits for every line before it */
+    while(table->batch_head != NULL && job_finished(table->batch_head)){
+        struct Job *job = table->batch_head;
+        table->batch_head = job->next_batch;
+        report_job(job);
+        job_free(table, job);
+        reported++;
+    }
+    if(table->batch_head == NULL){
+        table->batch_tail = NULL;
+    }
+    return reported;
+}
+
+void drain_batch(struct JobTable *table){
+    /* Waits until every batch line has finished and been reported (the barrier before builtins) */
+    while(table->batch_running > 0 || table->batch_head != NULL){
+        handle_events(table, -1);
+        report_finished_jobs(table);
+    }
+}
+
+int check_background_processes(struct JobTable *table){
+    /*Collect whatever has exited without blocking, then report the jobs that are now complete*/
+    while(handle_events(table, 0) > 0){
+        continue;
+    }
+    return report_finished_jobs(table);
+}
+
+void wait_for_job(struct JobTable *table, struct Job *job, bool reads_stdin){
+    /* Blocks until every stage of the job is reaped. Unless the job reads the shell's stdin itself,
+       the next lines are read meanwhile (typeahead) */
+    watch_stdin(table, !reads_stdin);
+    while(!job_finished(job)){
+        handle_events(table, -1);
+        report_finished_jobs(table); //background jobs get reported as soon as they finish
+    }
+    watch_stdin(table, true);
+}
+
+#define ARGUMENT_LENGTH_MAX (32 * 4096) //Linux refuses any single argument longer than this (MAX_ARG_STRLEN)
+
+struct ArenaChunk {
+    struct ArenaChunk *next; //older chunk
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct Arena {
+    struct ArenaChunk *chunks; //newest first, allocations come out of the first one
+    size_t total; //size of every chunk together
+};
+
+void *arena_alloc(struct Arena *arena, size_t size){
+    /* Bump allocation out of the current chunk. Nothing is freed on its own, only by arena_reset */
+    size = (size + 7) & ~(size_t)7; //keep everything pointer aligned
+    struct ArenaChunk *chunk = arena->chunks;
+
+    if(chunk == NULL || chunk->used + size > chunk->size){
+        size_t chunk_size = chunk ? chunk->size * 2 : 4096;
+        while(chunk_size < size){
+            chunk_size *= 2;
+        }
+        struct ArenaChunk *new_chunk = malloc(sizeof(struct ArenaChunk) + chunk_size);
+        new_chunk->next = chunk;
+        new_chunk->size = chunk_size;
+        new_chunk->used = 0;
+        arena->chunks = new_chunk;
+        arena->total += chunk_size;
+        chunk = new_chunk;
+    }
+
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+void arena_reset(struct Arena *arena){
+    /* Throws away everything the last line allocated. If it needed more than one chunk,
+       they are merged into one that big so the next line like it needs no malloc at all */
+    if(arena->chunks != NULL && arena->chunks->next != NULL){
+        size_t total = arena->total;
+        while(arena->chunks != NULL){
+            struct ArenaChunk *next = arena->chunks->next;
+            free(arena->chunks);
+            arena->chunks = next;
+        }
+        arena->chunks = malloc(sizeof(struct ArenaChunk) + total);
+        arena->chunks->next = NULL;
+        arena->chunks->size = total;
+    }
+    if(arena->chunks != NULL){
+        arena->chunks->used = 0;
+    }
+}
+
+struct CommandLine {
+    struct Command *commands; //one per stage of the pipeline, in the arena
+    int num_commands;
+    bool background; //will become true if there is an ambersand at the end
+    bool timed; //the line started with the time prefix
+    bool metered; //the line started with the meter prefix
+    bool memoized; //the line started with the memo prefix
+    bool batch; //set by main under -j: run it alongside the next lines instead of waiting for it
+    struct Substitution *substitutions; //every <(...) and >(...) of the line, in the arena
+    int num_substitutions;
+};
+
+#define SUBSTITUTION_WORD 24 //room for /dev/fd/ and any fd number
+
+struct Substitution {
+    struct Command command; //what's inside the parentheses, one command with its arguments
+    bool output; //>(...): the line writes into it, <(...): the line reads what it prints
+    char *word; //the argument that stands for it, /dev/fd/N once it's started
+};
+
+struct Parser {
+    struct Arena arena; //every string and array of a parsed line lives here, reset after each command
+    char **words; //arguments of the stage being read, copied to the arena once the stage ends
+    int words_capacity;
+    struct Command *stages; //stages of the line being read
+    int stages_capacity;
+    struct Substitution *substitutions; //process substitutions of the line being read
+    int substitutions_capacity;
+};
+
+bool is_operator(char c){
+    return c == '<' || c == '>' || c == '|' || c == '&';
+}
+
+char *skip_whitespace(char *c){
+    while(isspace((unsigned char)*c)){
+        c++;
+    }
+    return c;
+}
+
+int line_prefix(char *c, const char *word){
+    /* The length of word if the line starts with it as a separate word and a command follows, 0 if not */
+    int length = strlen(word);
+    if(strncmp(c, word, length) || !isspace((unsigned char)c[length]) || *skip_whitespace(c + length) == '\0'){
+        return 0;
+    }
+    return length;
+}
+
+/* Shell variables, in an open addressing table like the path cache. The exported ones are also kept
+   as NAME=value strings in one array that environ points to, so a spawn passes environ as it is and a
+   change rewrites only the string it is about. A builtin thread may be spawning from environ while it
+   changes, so the strings and arrays that get replaced are retired, and freed once none is running */
+#define VARIABLE_NAME_MAX 256 //longer $names are left as they are
+
+struct Variable {
+    char *name; //NULL if the slot is empty
+    char *entry; //NAME=value, the value starts after the =
+    int environment_index; //where entry is in the environment, -1 if it isn't exported
+};
+
+struct Variables {
+    struct Variable *slots; //open addressing, linear probing
+    int capacity; //always a power of 2
+    int count;
+    char **environment; //the exported entries and a NULL, what environ points to
+    char **environment_names; //the name of each, to find its variable when an entry moves
+    int environment_count;
+    int environment_capacity;
+    long environment_bytes; //what it takes out of ARG_MAX in every exec: its strings and their pointers
+    void **retired; //replaced entries and arrays, a builtin thread may still be reading them
+    int num_retired;
+    int retired_capacity;
+};
+
+struct Variables variables = { 0 };
+
+void variable_retire(void *pointer){
+    if(variables.num_retired == variables.retired_capacity){
+        variables.retired_capacity = variables.retired_capacity ? variables.retired_capacity * 2 : 16;
+        variables.retired = realloc(variables.retired, variables.retired_capacity * sizeof(void *));
+    }
+    variables.retired[variables.num_retired++] = pointer;
+}
+
+void variables_reclaim(void){
+    /* Frees everything retired, only while no builtin thread is running */
+    for(int i = 0; i < variables.num_retired; i++){
+        free(variables.retired[i]);
+    }
+    variables.num_retired = 0;
+}
+
+struct Variable *variable_slot(const char *name){
+    /* The slot holding name, or the empty slot where it would go */
+    int i = string_hash(name) & (variables.capacity - 1);
+    while(variables.slots[i].name != NULL && strcmp(variables.slots[i].name, name)){
+        i = (i + 1) & (variables.capacity - 1);
+    }
+    return &variables.slots[i];
+}
+
+char *variable_value(const char *name){
+    /* NULL if it isn't set */
+    if(variables.capacity == 0){
+        return NULL;
+    }
+    struct Variable *variable = variable_slot(name);
+    return variable->name != NULL ? variable->entry + strlen(name) + 1 : NULL;
+}
+
+bool variable_name_valid(const char *name, size_t length){
+    if(length == 0 || length >= VARIABLE_NAME_MAX || isdigit((unsigned char)name[0])){
+        return false;
+    }
+    for(size_t i = 0; i < length; i++){
+        if(!isalnum((unsigned char)name[i]) && name[i] != '_'){
+            return false;
+        }
+    }
+    return true;
+}
+
+void environment_add(struct Variable *variable){
+    if(variables.environment_count + 2 > variables.environment_capacity){
+        /* A new array rather than realloc: the old one stays readable until it's reclaimed */
+        int capacity = variables.environment_capacity * 2;
+        char **environment = malloc(capacity * sizeof(char *));
+        memcpy(environment, variables.environment, (variables.environment_count + 1) * sizeof(char *));
+        variable_retire(variables.environment);
+        variables.environment = environment;
+        variables.environment_names = realloc(variables.environment_names, capacity * sizeof(char *));
+        variables.environment_capacity = capacity;
+        environ = environment;
+    }
+    int i = variables.environment_count++;
+    variables.environment[i + 1] = NULL;
+    variables.environment[i] = variable->entry;
+    variables.environment_names[i] = variable->name;
+    variable->environment_index = i;
+    variables.environment_bytes += strlen(variable->entry) + 1 + sizeof(char *);
+}
+
+void environment_remove(struct Variable *variable){
+    /* The last entry takes its place, so the array has no holes. That's done in a new array, like a
+       growing one: a thread spawning from the old one must never see an entry move or the end come early */
+    int i = variable->environment_index;
+    int last = --variables.environment_count;
+    variables.environment_bytes -= strlen(variable->entry) + 1 + sizeof(char *);
+    char **environment = malloc(variables.environment_capacity * sizeof(char *));
+    memcpy(environment, variables.environment, (last + 1) * sizeof(char *));
+    if(i != last){
+        environment[i] = environment[last];
+        variables.environment_names[i] = variables.environment_names[last];
+        variable_slot(variables.environment_names[i])->environment_index = i;
+    }
+    environment[last] = NULL;
+    variable_retire(variables.environment);
+    variables.environment = environment;
+    environ = environment;
+    variable->environment_index = -1;
+}
+
+void variable_set(const char *name, const char *value, bool export){
+    /* Stays exported if it was, becomes exported if export is true */
+    if((variables.count + 1) * 2 > variables.capacity){ //keep it under half full
+        struct Variable *old_slots = variables.slots;
+        int old_capacity = variables.capacity;
+        variables.capacity = old_capacity ? old_capacity * 2 : 64;
+        variables.slots = calloc(variables.capacity, sizeof(struct Variable));
+        for(int i = 0; i < old_capacity; i++){
+            if(old_slots[i].name != NULL){
+                *variable_slot(old_slots[i].name) = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    size_t name_length = strlen(name);
+    size_t value_length = strlen(value);
+    char *entry = malloc(name_length + value_length + 2);
+    memcpy(entry, name, name_length);
+    entry[name_length] = '=';
+    memcpy(entry + name_length + 1, value, value_length + 1);
+
+    struct Variable *variable = variable_slot(name);
+    if(variable->name == NULL){
+        variable->name = strdup(name);
+        variable->entry = entry;
+        variable->environment_index = -1;
+        variables.count++;
+    }
+    else if(variable->environment_index >= 0){
+        variables.environment_bytes += (long)strlen(entry) - (long)strlen(variable->entry);
+        variables.environment[variable->environment_index] = entry;
+        variable_retire(variable->entry);
+        variable->entry = entry;
+    }
+    else{
+        free(variable->entry);
+        variable->entry = entry;
+    }
+    if(export && variable->environment_index < 0){
+        environment_add(variable);
+    }
+}
+
+bool variable_export(const char *name){
+    /* false if there is no such variable */
+    if(variables.capacity == 0){
+        return false;
+    }
+    struct Variable *variable = variable_slot(name);
+    if(variable->name == NULL){
+        return false;
+    }
+    if(variable->environment_index < 0){
+        environment_add(variable);
+    }
+    return true;
+}
+
+bool variable_unset(const char *name){
+    /* Drops it, then re-seats the rest of its probe run. Returns whether it was exported */
+    if(variables.capacity == 0){
+        return false;
+    }
+    struct Variable *variable = variable_slot(name);
+    if(variable->name == NULL){
+        return false;
+    }
+    bool exported = variable->environment_index >= 0;
+    if(exported){
+        environment_remove(variable);
+        variable_retire(variable->entry);
+    }
+    else{
+        free(variable->entry);
+    }
+    free(variable->name);
+    variable->name = NULL;
+    variables.count--;
+
+    int i = (variable - variables.slots + 1) & (variables.capacity - 1);
+    while(variables.slots[i].name != NULL){
+        struct Variable moved = variables.slots[i];
+        variables.slots[i].name = NULL;
+        *variable_slot(moved.name) = moved;
+        i = (i + 1) & (variables.capacity - 1);
+    }
+    return exported;
+}
+
+void variables_init(void){
+    /* Takes over the environment the shell was started with */
+    variables.environment_capacity = 64;
+    variables.environment = malloc(variables.environment_capacity * sizeof(char *));
+    variables.environment_names = malloc(variables.environment_capacity * sizeof(char *));
+    variables.environment[0] = NULL;
+    variables.environment_bytes = sizeof(char *);
+    for(char **entry = environ; *entry != NULL; entry++){
+        char *equals = strchr(*entry, '=');
+        if(equals == NULL || equals == *entry){
+            continue;
+        }
+        char *name = strndup(*entry, equals - *entry);
+        variable_set(name, equals + 1, true);
+        free(name);
+    }
+    environ = variables.environment;
+}
+
+size_t variable_reference(const char *c, const char *end, const char **value, char *number){
+    /* How long the $ reference at c is, 0 if it isn't one (the $ is then just a character). Its value
+       goes in *value, NULL for an unset variable; $? and $$ are written out in number */
+    if(c + 1 < end && (c[1] == '?' || c[1] == '$')){
+        snprintf(number, 24, "%d", c[1] == '?' ? last_status : (int)getpid());
+        *value = number;
+        return 2;
+    }
+    bool braces = c + 1 < end && c[1] == '{';
+    const char *name = c + 1 + braces;
+    const char *name_end = name;
+    while(name_end < end && (isalnum((unsigned char)*name_end) || *name_end == '_')){
+        name_end++;
+    }
+    if(!variable_name_valid(name, name_end - name) || (braces && (name_end == end || *name_end != '}'))){
+        return 0;
+    }
+    char buffer[VARIABLE_NAME_MAX];
+    memcpy(buffer, name, name_end - name);
+    buffer[name_end - name] = '\0';
+    *value = variable_value(buffer);
+    return name_end - c + braces;
+}
+
+char *expand_word(const char *start, const char *end, struct Arena *arena){
+    /* The word with every $NAME, ${NAME}, $? and $$ in it replaced by the value. There is no field
+       splitting, a value with spaces in it stays one argument */
+    char number[24];
+    const char *value;
+    size_t length = 0;
+    for(const char *c = start; c < end; ){
+        size_t taken = *c == '$' ? variable_reference(c, end, &value, number) : 0;
+        if(taken == 0){
+            length++;
+            c++;
+        }
+        else{
+            length += value != NULL ? strlen(value) : 0;
+            c += taken;
+        }
+    }
+
+    char *word = arena_alloc(arena, length + 1);
+    char *out = word;
+    for(const char *c = start; c < end; ){
+        size_t taken = *c == '$' ? variable_reference(c, end, &value, number) : 0;
+        if(taken == 0){
+            *out++ = *c++;
+        }
+        else{
+            if(value != NULL){
+                out = stpcpy(out, value);
+            }
+            c += taken;
+        }
+    }
+    *out = '\0';
+    return word;
+}
+
+char *read_word(char **cursor, struct Arena *arena){
+    /* Copies the word at the cursor into the arena, with its variables expanded. A word ends at whitespace or at any operator, so "echo>file" is 3 tokens */
+    char *start = *cursor;
+    char *end = start;
+    while(*end != '\0' && !isspace((unsigned char)*end) && !is_operator(*end)){
+        end++;
+    }
+    *cursor = end;
+
+    size_t length = end - start;
+    if(memchr(start, '$', length) != NULL){
+        return expand_word(start, end, arena);
+    }
+    char *word = arena_alloc(arena, length + 1);
+    memcpy(word, start, length);
+    word[length] = '\0';
+    return word;
+}
+
+/* Globs: a word with *, ? or [...] becomes the sorted names it matches, or stays as it is if it
+   matches nothing. Each directory a glob looks in is read with getdents64 in big batches and kept in
+   glob_cache, so globbing the same huge directory again is a stat and a walk over names in memory.
+   A listing is reused while the directory's (dev, inode, mtime) is the same, for GLOB_CACHE_TTL_NS,
+   and only if it was read GLOB_SETTLE_NS after that mtime: timestamps are coarse, a file made in
+   the same tick as the listing wouldn't change the mtime */
+#define GLOB_CACHE_SLOTS 16
+#define GLOB_CACHE_TTL_NS (10 * 1000000000LL)
+#define GLOB_SETTLE_NS (50 * 1000000LL)
+#define GETDENTS_BUFFER (256 * 1024)
+
+struct DirectoryListing {
+    dev_t device;
+    ino_t inode;
+    long long modified; //the directory's mtime in ns when it was read
+    long long loaded; //when it was read, same clock as mtime
+    char *names; //every name but . and .., one after the other with their NULs
+    size_t names_length;
+    size_t names_capacity;
+    int *offsets; //where each name starts in names
+    unsigned char *types; //d_type of each, DT_UNKNOWN on filesystems that don't say
+    int count;
+    int capacity;
+};
+
+struct DirectoryListing glob_cache[GLOB_CACHE_SLOTS];
+
+bool has_glob(const char *word){
+    /* A lone [ (the test builtin) isn't a glob, a bracket needs its ] */
+    for(const char *meta = strpbrk(word, "*?["); meta != NULL; meta = strpbrk(meta + 1, "*?[")){
+        if(*meta != '[' || strchr(meta, ']') != NULL){
+            return true;
+        }
+    }
+    return false;
+}
+
+long long timespec_ns(struct timespec time){
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+bool read_directory(const char *path, struct DirectoryListing *listing){
+    /* Reads every entry of the directory into listing, replacing what it had */
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0){
+        return false;
+    }
+    char *buffer = malloc(GETDENTS_BUFFER);
+    listing->count = 0;
+    listing->names_length = 0;
+    ssize_t n;
+    while((n = getdents64(fd, buffer, GETDENTS_BUFFER)) > 0){
+        for(ssize_t at = 0; at < n; ){
+            struct dirent64 *entry = (struct dirent64 *)(buffer + at);
+            at += entry->d_reclen;
+            if(entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))){
+                continue;
+            }
+            size_t length = strlen(entry->d_name) + 1;
+            if(listing->names_length + length > listing->names_capacity){
+                listing->names_capacity = (listing->names_length + length) * 2 + 4096;
+                listing->names = realloc(listing->names, listing->names_capacity);
+            }
+            if(listing->count == listing->capacity){
+                listing->capacity = listing->capacity * 2 + 256;
+                listing->offsets = realloc(listing->offsets, listing->capacity * sizeof(int));
+                listing->types = realloc(listing->types, listing->capacity);
+            }
+            memcpy(listing->names + listing->names_length, entry->d_name, length);
+            listing->offsets[listing->count] = listing->names_length;
+            listing->types[listing->count] = entry->d_type;
+            listing->count++;
+            listing->names_length += length;
+        }
+    }
+    free(buffer);
+    close(fd);
+    return n == 0;
+}
+
+struct DirectoryListing *glob_listing(const char *path){
+    /* The entries of a directory, from glob_cache if they can't have changed. NULL if it can't be read */
+    struct stat info;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now); //before the stat, so a change during the read shows up next time
+    if(stat(path, &info) != 0 || !S_ISDIR(info.st_mode)){
+        return NULL;
+    }
+    long long modified = timespec_ns(info.st_mtim);
+    struct DirectoryListing *listing = NULL;
+    struct DirectoryListing *oldest = &glob_cache[0];
+    for(int i = 0; i < GLOB_CACHE_SLOTS; i++){
+        struct DirectoryListing *entry = &glob_cache[i];
+        if(entry->loaded != 0 && entry->device == info.st_dev && entry->inode == info.st_ino){
+            listing = entry;
+            break;
+        }
+        if(entry->loaded < oldest->loaded){
+            oldest = entry;
+        }
+    }
+    if(listing != NULL && listing->modified == modified && timespec_ns(now) - listing->loaded < GLOB_CACHE_TTL_NS &&
+       listing->loaded - modified > GLOB_SETTLE_NS){
+        return listing;
+    }
+    if(listing == NULL){
+        listing = oldest;
+    }
+    listing->loaded = 0;
+    if(!read_directory(path, listing)){
+        return NULL;
+    }
+    listing->device = info.st_dev;
+    listing->inode = info.st_ino;
+    listing->modified = modified;
+    listing->loaded = timespec_ns(now);
+    return listing;
+}
+
+void parser_reserve_word(struct Parser *parser, int num_words){
+    /* Room for one more word and the NULL after it */
+    if(num_words + 1 >= parser->words_capacity){
+        parser->words_capacity = parser->words_capacity ? parser->words_capacity * 2 : 32;
+        parser->words = realloc(parser->words, parser->words_capacity * sizeof(char *));
+    }
+}
+
+int glob_add(struct Parser *parser, int num_words, const char *path, size_t length){
+    /* One match, into the stage's words */
+    parser_reserve_word(parser, num_words);
+    char *word = arena_alloc(&parser->arena, length + 1);
+    memcpy(word, path, length);
+    word[length] = '\0';
+    parser->words[num_words] = word;
+    return num_words + 1;
+}
+
+int glob_walk(struct Parser *parser, int num_words, char *path, size_t length, const char *rest){
+    /* Matches rest, what's left of the pattern, under path (length bytes of it are in use, ending in
+       a / unless it's empty). Returns the new number of words */
+    if(*rest == '\0'){ //the pattern ended with a /
+        return glob_add(parser, num_words, path, length);
+    }
+    const char *slash = strchr(rest, '/');
+    size_t component_length = slash ? (size_t)(slash - rest) : strlen(rest);
+    char component[NAME_MAX + 1];
+    if(component_length > NAME_MAX){
+        return num_words;
+    }
+    memcpy(component, rest, component_length);
+    component[component_length] = '\0';
+
+    if(!has_glob(component)){ //a plain name: no need to read the directory for it
+        if(length + component_length + 1 >= PATH_MAX){
+            return num_words;
+        }
+        memcpy(path + length, component, component_length);
+        size_t new_length = length + component_length;
+        path[new_length] = '\0';
+        struct stat info;
+        if(slash == NULL){ //the last component, it has to be there
+            return lstat(path, &info) == 0 ? glob_add(parser, num_words, path, new_length) : num_words;
+        }
+        path[new_length++] = '/';
+        return glob_walk(parser, num_words, path, new_length, slash + 1);
+    }
+
+    path[length] = '\0';
+    struct DirectoryListing *listing = glob_listing(length > 0 ? path : ".");
+    if(listing == NULL){
+        return num_words;
+    }
+    int first_match = num_words;
+    for(int i = 0; i < listing->count; i++){
+        const char *name = listing->names + listing->offsets[i];
+        if(fnmatch(component, name, FNM_PERIOD) != 0){ //FNM_PERIOD: * doesn't match a leading dot
+            continue;
+        }
+        size_t name_length = strlen(name);
+        if(length + name_length + 1 >= PATH_MAX){
+            continue;
+        }
+        struct stat info;
+        memcpy(path + length, name, name_length + 1);
+        if(slash != NULL && listing->types[i] != DT_DIR &&
+           (listing->types[i] == DT_REG || stat(path, &info) != 0 || !S_ISDIR(info.st_mode))){
+            continue; //d_type says so without a stat, unless it's a symlink or the filesystem doesn't tell
+        }
+        num_words = glob_add(parser, num_words, path, length + name_length);
+    }
+    if(slash == NULL){
+        return num_words;
+    }
+
+    /* The directories that matched are words for now, each is replaced by what matches under it.
+       Going deeper may push this listing out of the cache, so it isn't used past this point */
+    int num_directories = num_words - first_match;
+    char **directories = malloc(num_directories * sizeof(char *));
+    memcpy(directories, parser->words + first_match, num_directories * sizeof(char *));
+    num_words = first_match;
+    for(int i = 0; i < num_directories; i++){
+        size_t directory_length = strlen(directories[i]);
+        memcpy(path, directories[i], directory_length);
+        path[directory_length] = '/';
+        num_words = glob_walk(parser, num_words, path, directory_length + 1, slash + 1);
+    }
+    free(directories);
+    return num_words;
+}
+
+int compare_words(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int glob_expand(struct Parser *parser, int num_words, char *word){
+    /* Appends the names word matches, sorted, or word itself if none. Returns the new number of words */
+    char path[PATH_MAX];
+    size_t length = 0;
+    const char *rest = word;
+    if(*word == '/'){
+        path[length++] = '/';
+        rest = word + 1;
+    }
+    int matched = glob_walk(parser, num_words, path, length, rest);
+    if(matched == num_words){
+        parser->words[num_words] = word; //no match: the word is passed on as it is, like sh does
+        return num_words + 1;
+    }
+    qsort(parser->words + num_words, matched - num_words, sizeof(char *), compare_words);
+    return matched;
+}
+
+bool parse_cpu_list(const char *list, cpu_set_t *cpus){
+    /* A cpu list like the kernel's: 0-3,8,10-11 */
+    CPU_ZERO(cpus);
+    while(*list != '\0'){
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if(end == list){
+            return false;
+        }
+        if(*end == '-'){
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if(end == list){
+                return false;
+            }
+        }
+        if(first < 0 || last < first || last >= CPU_SETSIZE){
+            return false;
+        }
+        for(long cpu = first; cpu <= last; cpu++){
+            CPU_SET(cpu, cpus);
+        }
+        if(*end == ','){
+            end++;
+        }
+        else if(*end != '\0' && *end != '\n'){
+            return false;
+        }
+        list = end;
+        if(*list == '\n'){
+            break;
+        }
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+bool parse_placement(const char *word, struct Placement *placement){
+    /* @cpu=LIST, @cpu=auto or @mem=NODE */
+    if(!strncmp(word, "@mem=", 5)){
+        char *end;
+        placement->memory_node = strtol(word + 5, &end, 10);
+        return end != word + 5 && *end == '\0' && placement->memory_node >= 0 && placement->memory_node < 1024;
+    }
+    if(!strcmp(word + 5, "auto")){
+        placement->automatic = true;
+        return true;
+    }
+    placement->has_cpus = true;
+    return parse_cpu_list(word + 5, &placement->cpus);
+}
+
+void end_stage(struct Parser *parser, int num_stages, int num_words, char *input, bool here_string, char *output, struct Placement *placement){
+    /* Turns the words collected for a stage into its argv, in the arena */
+    if(num_stages == parser->stages_capacity){
+        parser->stages_capacity = parser->stages_capacity ? parser->stages_capacity * 2 : 4;
+        parser->stages = realloc(parser->stages, parser->stages_capacity * sizeof(struct Command));
+    }
+
+    struct Command *stage = &parser->stages[num_stages];
+    stage->arguments = arena_alloc(&parser->arena, (num_words + 1) * sizeof(char *));
+    memcpy(stage->arguments, parser->words, num_words * sizeof(char *));
+    stage->arguments[num_words] = NULL; //null-terminate
+    stage->num_arguments = num_words;
+    stage->placement = placement;
+    stage->input = input;
+    stage->here_string = here_string;
+    stage->output = output;
+    stage->read_fd = -1;
+    stage->write_fd = -1;
+    stage->pid = -1;
+}
+
+/*Finds errors left to right while splitting the line into stages, arguments and redirections, all in one pass.
+  Syntax errors stop right away; argument counts and mislocated redirections are only reported
+  once the whole line is known to be well formed. Returns the number of commands, or -1 on error*/
+int parse_command_line(char *cmd, struct CommandLine *line, struct Parser *parser){
+    int num_stages = 0;
+    int num_words = 0;
+    char *input = NULL; //redirections of the stage being read
+    bool here_string = false;
+    char *output = NULL;
+    int num_substitutions = 0;
+    char first_redirection = '\0'; //which one came first, if a stage has both
+    long argument_bytes = sizeof(char *); //what this stage's argv costs against ARG_MAX, counting the NULL at the end
+    bool too_many_arguments = false;
+    const char *mislocated = NULL;
+    struct Placement *placement = NULL; //of the stage being read
+
+    line->num_commands = 0;
+    line->num_substitutions = 0;
+    line->background = false;
+    line->timed = false;
+    line->metered = false;
+    line->memoized = false;
+
+    char *c = skip_whitespace(cmd);
+    if(*c == '\0'){
+        return 0; //no input
+    }
+    while(1){ //prefixes for the whole line, not commands, in any order
+        int length;
+        if((length = line_prefix(c, "time")) > 0){
+            line->timed = true;
+        }
+        else if((length = line_prefix(c, "meter")) > 0){
+            line->metered = true;
+        }
+        else if((length = line_prefix(c, "memo")) > 0){
+            line->memoized = true;
+        }
+        else{
+            break;
+        }
+        c = skip_whitespace(c + length);
+    }
+    if(is_operator(*c)){ //expecting a command, not symbols
+        fprintf(stderr, "%s", MISSING_COMMAND);
+        return -1;
+    }
+
+    while(1){
+        c = skip_whitespace(c);
+
+        if(*c == '\0' || *c == '|'){ //end of this stage
+            bool last = (*c == '\0');
+            if(argument_bytes > argument_bytes_max){ //execve would fail with E2BIG
+                too_many_arguments = true;
+            }
+            if(mislocated == NULL){
+                bool bad_output = (output != NULL && !last);
+                bool bad_input = (input != NULL && num_stages > 0);
+                if(bad_output && (!bad_input || first_redirection == '>')){
+                    mislocated = MISLOCATED_OUTPUT; //only the last command can write to a file
+                }
+                else if(bad_input){
+                    mislocated = MISLOCATED_INPUT; //only the first command can read from a file
+                }
+            }
+            if(num_words == 0){ //only @ words
+                fprintf(stderr, "%s", MISSING_COMMAND);
+                return -1;
+            }
+            end_stage(parser, num_stages, num_words, input, here_string, output, placement);
+            num_stages++;
+            num_words = 0;
+            argument_bytes = sizeof(char *);
+            input = NULL;
+            here_string = false;
+            output = NULL;
+            placement = NULL;
+            first_redirection = '\0';
+
+            if(last){
+                break;
+            }
+            c = skip_whitespace(c + 1);
+            if(*c == '\0' || is_operator(*c)){ //a pipe needs a command after it
+                fprintf(stderr, "%s", MISSING_COMMAND);
+                return -1;
+            }
+            continue;
+        }
+
+        if(*c == '&'){
+            if(*skip_whitespace(c + 1) != '\0'){ //ambersand was not at the end of the string
+                fprintf(stderr, "Error: mislocated background sign\n");
+                return -1;
+            }
+            line->background = true;
+            c++;
+            continue;
+        }
+
+        if((*c == '<' || *c == '>') && c[1] == '('){ //process substitution: an argument naming a pipe to or from a command
+            char *close = strchr(c + 2, ')');
+            if(close == NULL){
+                fprintf(stderr, "Error: unterminated process substitution\n");
+                return -1;
+            }
+            *close = '\0'; //just while its words are read
+            char *inner = c + 2;
+            int end = num_words; //its words go after the stage's, in the same scratch array
+            while(*(inner = skip_whitespace(inner)) != '\0' && !is_operator(*inner)){
+                parser_reserve_word(parser, end);
+                char *word = read_word(&inner, &parser->arena);
+                if(*word == '\0'){
+                    continue; //an unset variable, no argument at all
+                }
+                if(has_glob(word)){
+                    end = glob_expand(parser, end, word);
+                }
+                else{
+                    parser->words[end++] = word;
+                }
+            }
+            bool invalid = *inner != '\0' || end == num_words; //one command, no pipes or redirections inside
+            *close = ')';
+            if(invalid){
+                fprintf(stderr, "Error: invalid process substitution\n");
+                return -1;
+            }
+
+            if(num_substitutions == parser->substitutions_capacity){
+                parser->substitutions_capacity = parser->substitutions_capacity ? parser->substitutions_capacity * 2 : 4;
+                parser->substitutions = realloc(parser->substitutions, parser->substitutions_capacity * sizeof(struct Substitution));
+            }
+            struct Substitution *substitution = &parser->substitutions[num_substitutions++];
+            struct Command *command = &substitution->command;
+            memset(command, 0, sizeof(*command));
+            command->num_arguments = end - num_words;
+            command->arguments = arena_alloc(&parser->arena, (command->num_arguments + 1) * sizeof(char *));
+            memcpy(command->arguments, parser->words + num_words, command->num_arguments * sizeof(char *));
+            command->arguments[command->num_arguments] = NULL;
+            command->read_fd = -1;
+            command->write_fd = -1;
+            command->pid = -1;
+            substitution->output = *c == '>';
+            substitution->word = arena_alloc(&parser->arena, SUBSTITUTION_WORD);
+            strcpy(substitution->word, "/dev/fd/"); //the number is only known once it's started
+
+            parser_reserve_word(parser, num_words);
+            parser->words[num_words++] = substitution->word;
+            argument_bytes += SUBSTITUTION_WORD + sizeof(char *);
+            c = close + 1;
+            continue;
+        }
+
+        if(c[0] == '<' && c[1] == '<' && c[2] == '<'){ //here-string: the word (and a newline) is the input
+            c = skip_whitespace(c + 3);
+            if(*c == '\0' || is_operator(*c)){
+                fprintf(stderr, "%s", NO_INPUT);
+                return -1;
+            }
+            input = read_word(&c, &parser->arena);
+            here_string = true;
+            if(first_redirection == '\0'){
+                first_redirection = '<';
+            }
+            continue;
+        }
+
+        if(*c == '<' || *c == '>'){ //expecting a file name next
+            char symbol = *c;
+            c = skip_whitespace(c + 1);
+            if((*c == '<' || *c == '>') && c[1] == '('){ //the files are opened before any substitution starts
+                fprintf(stderr, "Error: cannot redirect to a process substitution\n");
+                return -1;
+            }
+            if(*c == '\0' || is_operator(*c)){
+                fprintf(stderr, "%s", symbol == '>' ? NO_OUTPUT : NO_INPUT);
+                return -1;
+            }
+            char *filename = read_word(&c, &parser->arena);
+            if(symbol == '>'){
+                output = filename;
+            }
+            else{
+                input = filename;
+                here_string = false;
+            }
+            if(first_redirection == '\0'){
+                first_redirection = symbol;
+            }
+            continue;
+        }
+
+        if(num_words + 1 >= parser->words_capacity){
+            parser->words_capacity = parser->words_capacity ? parser->words_capacity * 2 : 32;
+            parser->words = realloc(parser->words, parser->words_capacity * sizeof(char *));
+        }
+        char *word = read_word(&c, &parser->arena);
+        if(*word == '\0'){
+            continue; //an unset variable, no argument at all
+        }
+        if(num_words == 0 && (!strncmp(word, "@cpu=", 5) || !strncmp(word, "@mem=", 5))){ //placement, before the command
+            if(placement == NULL){
+                placement = arena_alloc(&parser->arena, sizeof(struct Placement));
+                memset(placement, 0, sizeof(struct Placement));
+                placement->memory_node = -1;
+            }
+            if(!parse_placement(word, placement)){
+                fprintf(stderr, "Error: invalid placement\n");
+                return -1;
+            }
+            continue;
+        }
+        int first_word = num_words;
+        if(has_glob(word)){
+            num_words = glob_expand(parser, num_words, word);
+        }
+        else{
+            parser->words[num_words++] = word;
+        }
+        for(int i = first_word; i < num_words; i++){
+            size_t length = strlen(parser->words[i]);
+            if(length >= ARGUMENT_LENGTH_MAX){
+                too_many_arguments = true;
+            }
+            argument_bytes += length + 1 + sizeof(char *);
+        }
+    }
+
+    if(too_many_arguments){
+        fprintf(stderr, "Error: too many process arguments\n");
+        return -1;
+    }
+    if(mislocated != NULL){
+        fprintf(stderr, "%s", mislocated);
+        return -1;
+    }
+
+    line->commands = arena_alloc(&parser->arena, num_stages * sizeof(struct Command));
+    if(num_stages > 0){ //memcpy from a NULL scratch array is undefined even for 0 bytes
+        memcpy(line->commands, parser->stages, num_stages * sizeof(struct Command));
+    }
+    line->num_commands = num_stages;
+    line->substitutions = arena_alloc(&parser->arena, num_substitutions * sizeof(struct Substitution));
+    if(num_substitutions > 0){
+        memcpy(line->substitutions, parser->substitutions, num_substitutions * sizeof(struct Substitution));
+    }
+    line->num_substitutions = num_substitutions;
+    return num_stages;
+}
+
+int write_all(int fd, const char *data, size_t length);
+
+int parse_input_output_files(struct CommandLine *line){
+    /* Opens the redirection files once the line is known to be valid. Only the first command
+       can have an input file and only the last an output file, the parser made sure of that */
+    struct Command *first = &line->commands[0];
+    struct Command *last = &line->commands[line->num_commands - 1];
+
+    if(first->input != NULL && first->here_string){ //in memory, no file is ever made
+        first->read_fd = memfd_create("sshell-here-string", MFD_CLOEXEC);
+        size_t length = strlen(first->input);
+        if(first->read_fd < 0 || write_all(first->read_fd, first->input, length) || write_all(first->read_fd, "\n", 1)
+           || lseek(first->read_fd, 0, SEEK_SET) != 0){
+            fprintf(stderr, "%s", INPUT_UNOPENED);
+            return -1;
+        }
+    }
+    else if(first->input != NULL){
+        TRACE(TRACE_OPEN, 0, first->input);
+        first->read_fd = open(first->input, O_RDONLY | O_CLOEXEC);
+        if(first->read_fd < 0){
+            fprintf(stderr, "%s", INPUT_UNOPENED);
+            return -1;
+        }
+    }
+    if(last->output != NULL){
+        TRACE(TRACE_OPEN, 0, last->output);
+        last->write_fd = open(last->output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(last->write_fd < 0){
+            fprintf(stderr, "%s", OUTPUT_UNOPENED);
+            if(first->read_fd >= 0){
+                close(first->read_fd);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int extract_tokens(char *cmd, struct CommandLine *line, struct Parser *parser){
+    /*GOAL: extracting all the command(s) and their respective arguments, then opening their files*/
+    TRACE(TRACE_PARSE_START, 0, NULL);
+    int num_commands = parse_command_line(cmd, line, parser);
+    TRACE(TRACE_PARSE_END, 0, NULL);
+    if(num_commands <= 0){
+        return num_commands; //-1 on error, in order to reprompt the shell
+    }
+
+    /*assigns the input and output fils to the command if needed*/
+    if(parse_input_output_files(line) == -1){
+        return -1; //if error
+    }
+    return num_commands;
+}
+
+struct PathEntry {
+    char *name; //command name as typed, NULL if the slot is empty
+    char *path; //where it was found on PATH
+    unsigned long hits;
+};
+
+struct PathCache {
+    struct PathEntry *entries; //open addressing, linear probing
+    int capacity; //always a power of 2
+    int count;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct PathCache path_cache = { 0 }; //command name -> absolute path, so execs skip the PATH walk; cleared when PATH is set
+
+unsigned long string_hash(const char *string){
+    unsigned long hash = 14695981039346656037UL; //FNV-1a
+    for(; *string != '\0'; string++){
+        hash = (hash ^ (unsigned char)*string) * 1099511628211UL;
+    }
+    return hash;
+}
+
+void path_cache_clear(void){
+    for(int i = 0; i < path_cache.capacity; i++){
+        free(path_cache.entries[i].name);
+        free(path_cache.entries[i].path);
+        path_cache.entries[i].name = NULL;
+        path_cache.entries[i].path = NULL;
+    }
+    path_cache.count = 0;
+}
+
+struct PathEntry *path_cache_slot(const char *name){
+    /* The slot holding name, or the empty slot where it would go */
+    int i = string_hash(name) & (path_cache.capacity - 1);
+    while(path_cache.entries[i].name != NULL && strcmp(path_cache.entries[i].name, name)){
+        i = (i + 1) & (path_cache.capacity - 1);
+    }
+    return &path_cache.entries[i];
+}
+
+void path_cache_insert(const char *name, const char *path){
+    if((path_cache.count + 1) * 2 > path_cache.capacity){ //keep it under half full
+        struct PathEntry *old_entries = path_cache.entries;
+        int old_capacity = path_cache.capacity;
+        path_cache.capacity = old_capacity ? old_capacity * 2 : 64;
+        path_cache.entries = calloc(path_cache.capacity, sizeof(struct PathEntry));
+        for(int i = 0; i < old_capacity; i++){
+            if(old_entries[i].name != NULL){
+                *path_cache_slot(old_entries[i].name) = old_entries[i];
+            }
+        }
+        free(old_entries);
+    }
+    struct PathEntry *entry = path_cache_slot(name);
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    entry->hits = 0;
+    path_cache.count++;
+}
+
+void path_cache_remove(const char *name){
+    /* Drops one entry, then re-seats the rest of its probe run so lookups never stop early */
+    if(path_cache.capacity == 0){
+        return;
+    }
+    struct PathEntry *entry = path_cache_slot(name);
+    if(entry->name == NULL){
+        return;
+    }
+    free(entry->name);
+    free(entry->path);
+    entry->name = NULL;
+    path_cache.count--;
+
+    int i = (entry - path_cache.entries + 1) & (path_cache.capacity - 1);
+    while(path_cache.entries[i].name != NULL){
+        struct PathEntry moved = path_cache.entries[i];
+        path_cache.entries[i].name = NULL;
+        *path_cache_slot(moved.name) = moved;
+        i = (i + 1) & (path_cache.capacity - 1);
+    }
+}
+
+char *search_path(const char *name){
+    /* Walks PATH once, the way execvp would, and returns the first executable match (malloc'd) or NULL */
+    const char *directories = getenv("PATH");
+    if(directories == NULL){
+        directories = "/bin:/usr/bin";
+    }
+    size_t name_length = strlen(name);
+
+    while(1){
+        const char *end = strchr(directories, ':');
+        size_t length = end ? (size_t)(end - directories) : strlen(directories);
+
+        char *candidate = malloc(length + name_length + 3);
+        if(length == 0){
+            strcpy(candidate, "."); //an empty entry means the current directory
+            length = 1;
+        }
+        else{
+            memcpy(candidate, directories, length);
+        }
+        candidate[length] = '/';
+        strcpy(candidate + length + 1, name);
+
+        struct stat info;
+        if(stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0){
+            return candidate;
+        }
+        free(candidate);
+
+        if(end == NULL){
+            return NULL;
+        }
+        directories = end + 1;
+    }
+}
+
+char *resolve_command(const char *name){
+    /* Where the command lives, from the cache if possible. NULL if it isn't on PATH */
+    if(strchr(name, '/') != NULL){
+        return (char *)name; //a path already, nothing to look up
+    }
+
+    if(path_cache.capacity > 0){
+        struct PathEntry *entry = path_cache_slot(name);
+        if(entry->name != NULL){
+            path_cache.hits++;
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    path_cache.misses++;
+    char *path = search_path(name);
+    if(path == NULL){
+        return NULL;
+    }
+    path_cache_insert(name, path);
+    free(path);
+    struct PathEntry *entry = path_cache_slot(name);
+    entry->hits = 1;
+    return entry->path;
+}
+
+/* CPU and memory placement of stages. @cpu=LIST pins a stage to those cpus and @mem=N binds its memory
+   to NUMA node N. posix_spawn has no attribute for either, but a new process starts with the calling
+   thread's affinity mask and memory policy, so the shell puts itself there just for the spawn and
+   then goes back. @cpu=auto stages are given the cpus of one last level cache domain, adjacent stages
+   the same one while it has room, so the data going through their pipes stays in that cache */
+
+struct CacheDomains {
+    cpu_set_t *domains; //each one the set of cpus sharing a last level cache
+    int count; //0 until loaded
+    int next; //where the next pipeline starts, so pipelines take turns
+} cache_domains;
+
+void load_cache_domains(void){
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(!CPU_ISSET(cpu, &allowed)){
+            continue;
+        }
+        char shared[1024] = "";
+        for(int index = 0; ; index++){ //the last index is the last level
+            char path[128];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+            FILE *file = fopen(path, "re");
+            if(file == NULL){
+                break;
+            }
+            if(fgets(shared, sizeof(shared), file) == NULL){
+                shared[0] = '\0';
+            }
+            fclose(file);
+        }
+
+        cpu_set_t domain;
+        if(shared[0] == '\0' || !parse_cpu_list(shared, &domain)){
+            continue;
+        }
+        CPU_AND(&domain, &domain, &allowed);
+        bool known = false;
+        for(int i = 0; i < cache_domains.count && !known; i++){
+            known = CPU_EQUAL(&domain, &cache_domains.domains[i]);
+        }
+        if(!known){
+            cache_domains.domains = realloc(cache_domains.domains, (cache_domains.count + 1) * sizeof(cpu_set_t));
+            cache_domains.domains[cache_domains.count++] = domain;
+        }
+    }
+    if(cache_domains.count == 0){ //no cache topology in sysfs, everything counts as one domain
+        cache_domains.domains = malloc(sizeof(cpu_set_t));
+        cache_domains.domains[0] = allowed;
+        cache_domains.count = 1;
+    }
+}
+
+void place_automatic(struct CommandLine *line){
+    /* Turns the @cpu=auto stages of a line into cpu sets: consecutive ones fill one cache domain
+       (a stage per cpu) before moving on to the next */
+    int domain = -1;
+    int used = 0;
+    for(int i = 0; i < line->num_commands; i++){
+        struct Placement *placement = line->commands[i].placement;
+        if(placement == NULL || !placement->automatic){
+            continue;
+        }
+        if(cache_domains.count == 0){
+            load_cache_domains();
+        }
+        if(domain < 0){
+            domain = cache_domains.next++ % cache_domains.count;
+        }
+        else if(used == CPU_COUNT(&cache_domains.domains[domain])){
+            domain = (domain + 1) % cache_domains.count;
+            used = 0;
+        }
+        placement->cpus = cache_domains.domains[domain];
+        placement->has_cpus = true;
+        used++;
+    }
+}
+
+void place_thread(struct Placement *placement, cpu_set_t *saved){
+    /* Moves the calling thread where the stage should run, saved gets the cpus to go back to */
+    if(placement->has_cpus){
+        if(saved != NULL){
+            sched_getaffinity(0, sizeof(cpu_set_t), saved);
+        }
+        if(sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) != 0){
+            fprintf(stderr, "Error: cannot set cpu affinity\n");
+        }
+    }
+    if(placement->memory_node >= 0){
+        unsigned long nodes[1024 / (8 * sizeof(unsigned long))] = { 0 };
+        nodes[placement->memory_node / (8 * sizeof(unsigned long))] |= 1UL << (placement->memory_node % (8 * sizeof(unsigned long)));
+        if(syscall(SYS_set_mempolicy, MPOL_BIND, nodes, 1024 + 1) != 0){
+            fprintf(stderr, "Error: cannot set memory policy\n");
+        }
+    }
+}
+
+void unplace_thread(struct Placement *placement, cpu_set_t *saved){
+    if(placement->has_cpus){
+        sched_setaffinity(0, sizeof(cpu_set_t), saved);
+    }
+    if(placement->memory_node >= 0){
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    }
+}
+
+pid_t fork_command(char **arguments, int in_fd, int out_fd, struct Placement *placement, struct CommandStats *stats){
+    /* The old way of launching: a full fork() and then dup2/execvp in the child. A failed exec sends
+       its errno back through a close-on-exec pipe, so like posix_spawn it's -1 here and not a child
+       exiting with some code of its own */
+    TRACE(TRACE_SPAWN, 0, arguments[0]);
+    long long before = monotonic_ns();
+    int error_pipe[2];
+    if(pipe2(error_pipe, O_CLOEXEC) != 0){
+        stats_count(&stats->fork_failures);
+        return -1;
+    }
+    pid_t pid = fork();
+    if(pid == 0){ //this is the child
+        if(placement != NULL){
+            place_thread(placement, NULL); //only this process, nothing to go back to
+        }
+        if(in_fd >= 0){
+            dup2(in_fd, STDIN_FILENO); //dup2 also clears close-on-exec on the new descriptor
+        }
+        if(out_fd >= 0){
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        signal(SIGPIPE, SIG_DFL); //the shell ignores it, the program shouldn't
+        sigset_t no_signals;
+        sigemptyset(&no_signals);
+        sigprocmask(SIG_SETMASK, &no_signals, NULL); //and blocks the ones its event loop takes
+        execvp(arguments[0], arguments);
+        int error = errno;
+        write_all(error_pipe[1], (char *)&error, sizeof(error));
+        _exit(127); //not exit(), the atexit handlers belong to the shell
+    }
+    close(error_pipe[1]);
+    if(pid < 0){
+        close(error_pipe[0]);
+        stats_count(&stats->fork_failures);
+        return -1;
+    }
+
+    int error;
+    ssize_t n;
+    while((n = read(error_pipe[0], &error, sizeof(error))) < 0 && errno == EINTR){ //EOF once the exec closed it
+    }
+    close(error_pipe[0]);
+    if(n == sizeof(error)){
+        while(waitpid(pid, NULL, 0) < 0 && errno == EINTR){ //it's exiting right now, and no job knows its pid
+        }
+        stats_count(&stats->exec_failures);
+        fprintf(stderr, "%s", COMMAND_NOT_FOUND);
+        errno = error;
+        return -1;
+    }
+    TRACE(TRACE_FORK, pid, arguments[0]); //opens the child's span, so only once there is a child to close it
+    stats_time(stats, STATS_SPAWN, monotonic_ns() - before); //the fork and the exec, like posix_spawn
+    stats_count(&stats->runs);
+    return pid;
+}
+
+void spawn_attributes_init(posix_spawnattr_t *attributes){
+    posix_spawnattr_init(attributes);
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE); //ignored in the shell, and an ignored signal stays ignored across exec
+    posix_spawnattr_setsigdefault(attributes, &default_signals);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(attributes, &no_signals); //the shell blocks the ones its event loop takes
+    posix_spawnattr_setflags(attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+}
+
+/* Starts arguments[0] with its stdin/stdout wired to in_fd/out_fd (-1 keeps the shell's own).
+   Every descriptor the shell opens (pipes, redirection files) is close-on-exec, so the only
+   file actions needed are the two dup2s. The program comes from the path cache and is exec'd by
+   its absolute path. stats is the command's slot (stats_for). Returns the pid of the child, or -1 with
+   errno saying why if nothing was started */
+pid_t launch_command(char **arguments, int in_fd, int out_fd, struct Placement *placement, struct CommandStats *stats){
+    if(use_fork_launcher){
+        return fork_command(arguments, in_fd, out_fd, placement, stats);
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if(in_fd >= 0){
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if(out_fd >= 0){
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    posix_spawnattr_t attributes;
+    spawn_attributes_init(&attributes);
+
+    pid_t pid;
+    int error = ENOENT;
+    TRACE(TRACE_SPAWN, 0, arguments[0]);
+    long long before = monotonic_ns();
+    cpu_set_t saved_cpus;
+    if(placement != NULL){
+        place_thread(placement, &saved_cpus); //inherited by the child
+    }
+    char *path = resolve_command(arguments[0]);
+    if(path != NULL){
+        error = posix_spawn(&pid, path, &actions, &attributes, arguments, environ); //vfork-style, no page table copy
+        if((error == ENOENT || error == EACCES || error == ENOTDIR) && path != arguments[0]){
+            path_cache_remove(arguments[0]); //moved or deleted since we cached it, look it up again
+            path = resolve_command(arguments[0]);
+            if(path != NULL){
+                error = posix_spawn(&pid, path, &actions, &attributes, arguments, environ);
+            }
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if(placement != NULL){
+        unplace_thread(placement, &saved_cpus);
+    }
+
+    if(error == 0){
+        TRACE(TRACE_EXEC, pid, arguments[0]);
+        stats_time(stats, STATS_SPAWN, monotonic_ns() - before);
+        stats_count(&stats->runs);
+        return pid;
+    }
+    if(error == ENOEXEC){ //execvp runs scripts without a #! line through /bin/sh, posix_spawn doesn't
+        return fork_command(arguments, in_fd, out_fd, placement, stats);
+    }
+    stats_count(error == EAGAIN || error == ENOMEM ? &stats->fork_failures : &stats->exec_failures);
+    fprintf(stderr, "%s", COMMAND_NOT_FOUND); //the exec failed inside the spawn, so there is no child to report it
+    errno = error;
+    return -1;
+}
+
+struct BuiltinCall {
+    char **arguments; //NULL-terminated, arguments[0] is the builtin's name
+    int in_fd; //where it reads and writes: the shell's own stdin/stdout, a pipe or a redirection file
+    int out_fd;
+    struct JobTable *table; //only for the builtins that run in the shell itself, NULL on a thread
+    char *cmd_copy;
+};
+
+struct Builtin {
+    const char *name;
+    int (*run)(struct BuiltinCall *call); //returns the exit code
+    bool shell; //needs the shell's own state (cwd, jobs, path cache), so it only runs as a lone command
+    bool (*accepts)(char **arguments); //false for options or forms it doesn't implement, the real program
+                                       //runs those instead (NULL: it takes anything)
+};
+
+/* Output of a builtin, collected and then written in one go */
+struct Output {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+void output_append(struct Output *output, const char *data, size_t length){
+    if(output->length + length > output->capacity){
+        output->capacity = (output->length + length) * 2 + 64;
+        output->data = realloc(output->data, output->capacity);
+    }
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+int write_all(int fd, const char *data, size_t length){
+    /* Returns 1 if the reader went away (EPIPE) or the write failed, 0 once everything is written */
+    size_t written = 0;
+    while(written < length){
+        ssize_t n = write(fd, data + written, length - written);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return 1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+int output_write(struct Output *output, int fd){
+    /* Writes everything and frees it */
+    int exit_code = write_all(fd, output->data, output->length);
+    free(output->data);
+    return exit_code;
+}
+
+int exit_builtin(struct BuiltinCall *call){
+    struct JobTable *table = call->table;
+    check_background_processes(table); //something may have finished since the last prompt
+    if(table->running > 0){ //check if a background command is currently executing before we can exit
+        fprintf(stderr, "Error: active job still running\n");
+        return 1;
+    }
+    if(!quiet){
+        fprintf(stderr, "Bye...\n");
+    }
+    print_completion(call->cmd_copy, &(int){ 0 }, 1);
+    exit(0);
+}
+
+int cd_builtin(struct BuiltinCall *call){
+    if(chdir(call->arguments[1]) != 0){ //used chdir to change parent directory without forking. arguments[1] because 1 argument will be given only
+        fprintf(stderr,"Error: cannot cd into directory\n");
+        return 1;
+    }
+    return 0;
+}
+
+int pwd_builtin(struct BuiltinCall *call){
+    char *path = getcwd(NULL, 0); //gives pwd, same as cwd (allocated to fit, however deep we are)
+    if(path == NULL){
+        return 1;
+    }
+    struct Output output = { 0 };
+    output_append(&output, path, strlen(path));
+    output_append(&output, "\n", 1);
+    free(path);
+    return output_write(&output, call->out_fd);
+}
+
+int wait_builtin(struct BuiltinCall *call){
+    /* wait with no arguments waits for every background job, otherwise for the given job ids (%N or N) */
+    struct JobTable *table = call->table;
+    if(call->arguments[1] == NULL){
+        while(table->running > 0 && !interrupt_pending()){
+            handle_events(table, -1);
+            report_finished_jobs(table); //as they finish, not all at the end
+        }
+        report_finished_jobs(table);
+        return interrupt_pending() ? INTERRUPTED : 0;
+    }
+
+    int exit_code = 0;
+    for(int i = 1; call->arguments[i] != NULL; i++){
+        char *arg = call->arguments[i];
+        int id = atoi(arg[0] == '%' ? arg + 1 : arg);
+        struct Job *job = (id >= 1 && id <= table->next_unused) ? table->slots[id - 1] : NULL;
+        if(job == NULL || !job->background){
+            fprintf(stderr, "Error: no such job\n");
+            exit_code = 1;
+            continue;
+        }
+        while(!job_finished(job)){
+            handle_events(table, -1);
+            if(interrupt_pending()){
+                return INTERRUPTED; //stop waiting, the job keeps running
+            }
+        }
+        exit_code = job->exit_codes[job->num_stages - 1]; //like a shell, wait gives back the job's status
+        report_finished_jobs(table); //this also frees the job
+    }
+    return exit_code;
+}
+
+int hash_builtin(struct BuiltinCall *call){
+    /* hash: list the cache with its hit counts, hash -r: forget everything, hash name...: look them up now */
+    if(call->arguments[1] == NULL){
+        struct Output output = { 0 };
+        char text[64];
+        for(int i = 0; i < path_cache.capacity; i++){
+            struct PathEntry *entry = &path_cache.entries[i];
+            if(entry->name != NULL){
+                output_append(&output, text, snprintf(text, sizeof(text), "%lu\t", entry->hits));
+                output_append(&output, entry->name, strlen(entry->name));
+                output_append(&output, "\t", 1);
+                output_append(&output, entry->path, strlen(entry->path));
+                output_append(&output, "\n", 1);
+            }
+        }
+        output_append(&output, text, snprintf(text, sizeof(text), "hits %lu misses %lu\n", path_cache.hits, path_cache.misses));
+        return output_write(&output, call->out_fd);
+    }
+    if(!strcmp(call->arguments[1], "-r")){
+        path_cache_clear();
+        return 0;
+    }
+
+    int exit_code = 0;
+    for(int i = 1; call->arguments[i] != NULL; i++){
+        if(resolve_command(call->arguments[i]) == NULL){
+            fprintf(stderr, "%s", COMMAND_NOT_FOUND);
+            exit_code = 1;
+        }
+    }
+    return exit_code;
+}
+
+void load_settings(void);
+void argument_limit(void);
+
+void variable_changed(struct JobTable *table, const char *name, bool exported){
+    /* What depends on a variable follows it: the path cache PATH, the settings the SSHELL_ ones and
+       the argv budget every exported one. It's also when whatever was retired gets freed, if it can */
+    if(exported){
+        if(!strcmp(name, "PATH")){
+            path_cache_clear(); //resolved against the old one
+        }
+        if(!strncmp(name, "SSHELL_", 7)){
+            load_settings();
+        }
+        else{
+            argument_limit();
+        }
+    }
+    if(table->builtin_threads == 0){
+        variables_reclaim();
+    }
+}
+
+bool is_assignment(const char *word){
+    size_t name_length = strcspn(word, "=");
+    return word[name_length] == '=' && variable_name_valid(word, name_length);
+}
+
+bool assignment_command(struct Command *command){
+    /* NAME=value NAME=value...: a line of assignments and nothing else */
+    for(int i = 0; command->arguments[i] != NULL; i++){
+        if(!is_assignment(command->arguments[i])){
+            return false;
+        }
+    }
+    return command->arguments[0] != NULL;
+}
+
+void assign_variable(struct JobTable *table, const char *assignment, bool export){
+    size_t name_length = strcspn(assignment, "=");
+    char *name = strndup(assignment, name_length);
+    variable_set(name, assignment + name_length + 1, export);
+    variable_changed(table, name, variable_slot(name)->environment_index >= 0);
+    free(name);
+}
+
+int export_builtin(struct BuiltinCall *call){
+    /* export: list the environment, export NAME=value...: set and export, export NAME...: export a variable already set */
+    if(call->arguments[1] == NULL){
+        struct Output output = { 0 };
+        for(int i = 0; i < variables.environment_count; i++){
+            output_append(&output, variables.environment[i], strlen(variables.environment[i]));
+            output_append(&output, "\n", 1);
+        }
+        return output_write(&output, call->out_fd);
+    }
+
+    int exit_code = 0;
+    for(int i = 1; call->arguments[i] != NULL; i++){
+        char *argument = call->arguments[i];
+        if(is_assignment(argument)){
+            assign_variable(call->table, argument, true);
+        }
+        else if(!variable_name_valid(argument, strlen(argument))){
+            fprintf(stderr, "Error: invalid variable name\n");
+            exit_code = 1;
+        }
+        else if(variable_export(argument)){ //one that isn't set stays that way
+            variable_changed(call->table, argument, true);
+        }
+    }
+    return exit_code;
+}
+
+int unset_builtin(struct BuiltinCall *call){
+    for(int i = 1; call->arguments[i] != NULL; i++){
+        bool exported = variable_unset(call->arguments[i]);
+        variable_changed(call->table, call->arguments[i], exported);
+    }
+    return 0;
+}
+
+int jobs_builtin(struct BuiltinCall *call){
+    /* Lists the background jobs that are still running, by job id */
+    struct JobTable *table = call->table;
+    check_background_processes(table); //don't list jobs that are already done
+    struct Output output = { 0 };
+    char text[32];
+    for(int i = 0; i < table->next_unused; i++){
+        struct Job *job = table->slots[i];
+        if(job == NULL || !job->background || job_finished(job)){
+            continue;
+        }
+        output_append(&output, text, snprintf(text, sizeof(text), "[%d] Running '", job->id));
+        output_append(&output, job->command_string, strlen(job->command_string));
+        output_append(&output, "'", 1);
+        for(int j = 0; j < job->num_stages; j++){
+            output_append(&output, text, snprintf(text, sizeof(text), " %d", job->pids[j])); //-1 for stages that already finished, the shell's own pid for builtins
+        }
+        output_append(&output, "\n", 1);
+    }
+    return output_write(&output, call->out_fd);
+}
+
+int true_builtin(struct BuiltinCall *call){
+    (void)call;
+    return 0;
+}
+
+int false_builtin(struct BuiltinCall *call){
+    (void)call;
+    return 1;
+}
+
+bool echo_option(const char *argument){
+    /* -n, -e, -E or several of them in one, what /bin/echo takes as options */
+    return argument[0] == '-' && argument[1] != '\0' && strspn(argument + 1, "neE") == strlen(argument + 1);
+}
+
+bool echo_accepts(char **arguments){
+    /* Just -n, the escapes of -e are left to /bin/echo */
+    int first = arguments[1] != NULL && !strcmp(arguments[1], "-n") ? 2 : 1;
+    return arguments[first - 1] == NULL || arguments[first] == NULL || !echo_option(arguments[first]);
+}
+
+int echo_builtin(struct BuiltinCall *call){
+    /* echo [-n] words... */
+    char **arguments = call->arguments + 1;
+    bool newline = true;
+    if(arguments[0] != NULL && !strcmp(arguments[0], "-n")){
+        newline = false;
+        arguments++;
+    }
+    struct Output output = { 0 };
+    for(int i = 0; arguments[i] != NULL; i++){
+        if(i > 0){
+            output_append(&output, " ", 1);
+        }
+        output_append(&output, arguments[i], strlen(arguments[i]));
+    }
+    if(newline){
+        output_append(&output, "\n", 1);
+    }
+    return output_write(&output, call->out_fd);
+}
+
+int printf_escape(const char *format, char *c){
+    /* Decodes the backslash escape at format (just past the backslash), returns how many characters it used */
+    switch(format[0]){
+        case 'n': *c = '\n'; return 1;
+        case 't': *c = '\t'; return 1;
+        case 'r': *c = '\r'; return 1;
+        case 'a': *c = '\a'; return 1;
+        case 'b': *c = '\b'; return 1;
+        case 'f': *c = '\f'; return 1;
+        case 'v': *c = '\v'; return 1;
+        case '\\': *c = '\\'; return 1;
+        case '0': {
+            int value = 0;
+            int used = 1;
+            while(used < 4 && format[used] >= '0' && format[used] <= '7'){
+                value = value * 8 + (format[used] - '0');
+                used++;
+            }
+            *c = value;
+            return used;
+        }
+        case '\0': *c = '\\'; return 0;
+        default: *c = '\\'; return 0; //not an escape, keep the backslash as is
+    }
+}
+
+bool printf_accepts(char **arguments){
+    /* Only formats with the conversions and escapes printf_builtin knows, no options */
+    char *format = arguments[1];
+    if(format == NULL || format[0] == '-'){
+        return false;
+    }
+    for(char *f = format; *f != '\0'; f++){
+        if(*f == '\\'){
+            char c;
+            if(f[1] != '\0' && printf_escape(f + 1, &c) == 0){
+                return false; //\x41, \c, \e...
+            }
+            f += f[1] != '\0';
+        }
+        else if(*f == '%'){
+            size_t length = strspn(f + 1, "-+ #0123456789.");
+            if(f[1] != '%' && (length > 28 || f[1 + length] == '\0' || !strchr("diouxXcs", f[1 + length]))){
+                return false; //%f, %b, %q...
+            }
+            f += f[1] == '%' ? 1 : length + 1;
+        }
+    }
+    return true;
+}
+
+int printf_builtin(struct BuiltinCall *call){
+    /* printf format [arguments...], with the diouxXcs% conversions, flags, width, precision and backslash escapes.
+       Like the real one, the format is used again while arguments are left */
+    if(call->arguments[1] == NULL){
+        fprintf(stderr, "printf: missing format\n");
+        return 2;
+    }
+    char *format = call->arguments[1];
+    char **arguments = call->arguments + 2;
+    struct Output output = { 0 };
+    char buffer[512];
+
+    do{
+        bool consumed = false;
+        for(char *f = format; *f != '\0'; f++){
+            if(*f == '\\'){
+                char c;
+                f += printf_escape(f + 1, &c);
+                output_append(&output, &c, 1);
+                continue;
+            }
+            if(*f != '%'){
+                output_append(&output, f, 1);
+                continue;
+            }
+            if(f[1] == '%'){
+                output_append(&output, "%", 1);
+                f++;
+                continue;
+            }
+
+            char spec[32];
+            size_t length = strspn(f + 1, "-+ #0123456789."); //flags, width and precision
+            char conversion = f[1 + length];
+            if(length > sizeof(spec) - 4 || conversion == '\0' || !strchr("diouxXcs", conversion)){
+                fprintf(stderr, "printf: invalid format\n");
+                free(output.data);
+                return 1;
+            }
+            spec[0] = '%';
+            memcpy(spec + 1, f + 1, length);
+            f += length + 1;
+
+            char *argument = *arguments != NULL ? *arguments++ : "";
+            consumed = true;
+            int n;
+            if(conversion == 's'){
+                spec[length + 1] = 's';
+                spec[length + 2] = '\0';
+                n = snprintf(buffer, sizeof(buffer), spec, argument);
+            }
+            else if(conversion == 'c'){
+                spec[length + 1] = 'c';
+                spec[length + 2] = '\0';
+                n = snprintf(buffer, sizeof(buffer), spec, argument[0]);
+            }
+            else{ //integers go through long long
+                spec[length + 1] = 'l';
+                spec[length + 2] = 'l';
+                spec[length + 3] = conversion;
+                spec[length + 4] = '\0';
+                n = snprintf(buffer, sizeof(buffer), spec, strtoll(argument, NULL, 0));
+            }
+            if(n >= (int)sizeof(buffer)){ //a wide field or a long string, format it again at its real size
+                char *big = malloc(n + 1);
+                if(conversion == 's'){
+                    snprintf(big, n + 1, spec, argument);
+                }
+                else if(conversion == 'c'){
+                    snprintf(big, n + 1, spec, argument[0]);
+                }
+                else{
+                    snprintf(big, n + 1, spec, strtoll(argument, NULL, 0));
+                }
+                output_append(&output, big, n);
+                free(big);
+            }
+            else if(n > 0){
+                output_append(&output, buffer, n);
+            }
+        }
+        if(!consumed){
+            break; //no conversions, so the arguments would never run out
+        }
+    } while(*arguments != NULL);
+
+    return output_write(&output, call->out_fd);
+}
+
+const char *test_unary_operators[] = { "-n", "-z", "-e", "-f", "-d", "-s", "-L", "-h", "-r", "-w", "-x", NULL };
+const char *test_binary_operators[] = { "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL };
+
+bool test_operator(const char *word, const char **operators){
+    for(int i = 0; operators[i] != NULL; i++){
+        if(!strcmp(word, operators[i])){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool test_integer(const char *word){
+    char *end;
+    errno = 0;
+    strtoll(word, &end, 10);
+    return end != word && *end == '\0' && errno == 0;
+}
+
+bool test_form(char **arguments, int count){
+    /* Whether test_expression handles it: up to 3 arguments and a leading ! (no -a, -o or parentheses),
+       integers on both sides of -eq and the rest */
+    if(count == 3 && test_operator(arguments[1], test_binary_operators)){
+        return arguments[1][0] != '-' || (test_integer(arguments[0]) && test_integer(arguments[2]));
+    }
+    if(count > 0 && !strcmp(arguments[0], "!")){
+        return count <= 4 && test_form(arguments + 1, count - 1);
+    }
+    return count <= 1 || (count == 2 && test_operator(arguments[0], test_unary_operators));
+}
+
+bool test_accepts(char **arguments){
+    int count = 0;
+    while(arguments[count + 1] != NULL){
+        count++;
+    }
+    if(!strcmp(arguments[0], "[")){
+        if(count == 0 || strcmp(arguments[count], "]")){
+            return false; //the real [ says what's missing
+        }
+        count--;
+    }
+    return test_form(arguments + 1, count);
+}
+
+int test_unary(const char *op, const char *operand){
+    /* Returns 0/1 like test, or -1 if op isn't a unary operator */
+    struct stat info;
+    if(!strcmp(op, "-n")) return operand[0] == '\0';
+    if(!strcmp(op, "-z")) return operand[0] != '\0';
+    if(!strcmp(op, "-e")) return stat(operand, &info) != 0;
+    if(!strcmp(op, "-f")) return stat(operand, &info) != 0 || !S_ISREG(info.st_mode);
+    if(!strcmp(op, "-d")) return stat(operand, &info) != 0 || !S_ISDIR(info.st_mode);
+    if(!strcmp(op, "-s")) return stat(operand, &info) != 0 || info.st_size == 0;
+    if(!strcmp(op, "-L") || !strcmp(op, "-h")) return lstat(operand, &info) != 0 || !S_ISLNK(info.st_mode);
+    if(!strcmp(op, "-r")) return access(operand, R_OK) != 0;
+    if(!strcmp(op, "-w")) return access(operand, W_OK) != 0;
+    if(!strcmp(op, "-x")) return access(operand, X_OK) != 0;
+    return -1;
+}
+
+int test_binary(const char *left, const char *op, const char *right){
+    /* Returns 0/1 like test, or -1 if op isn't a binary operator */
+    if(!strcmp(op, "=") || !strcmp(op, "==")) return strcmp(left, right) != 0;
+    if(!strcmp(op, "!=")) return strcmp(left, right) == 0;
+
+    long long a = strtoll(left, NULL, 10);
+    long long b = strtoll(right, NULL, 10);
+    if(!strcmp(op, "-eq")) return !(a == b);
+    if(!strcmp(op, "-ne")) return !(a != b);
+    if(!strcmp(op, "-lt")) return !(a < b);
+    if(!strcmp(op, "-le")) return !(a <= b);
+    if(!strcmp(op, "-gt")) return !(a > b);
+    if(!strcmp(op, "-ge")) return !(a >= b);
+    return -1;
+}
+
+int test_expression(char **arguments, int count){
+    /* The POSIX rules by argument count, no -a/-o/parentheses. 0 true, 1 false, 2 error */
+    if(count == 3 && test_operator(arguments[1], test_binary_operators)){
+        return test_binary(arguments[0], arguments[1], arguments[2]); //before !, so test ! = x compares strings
+    }
+    if(count > 0 && !strcmp(arguments[0], "!") && count <= 4){
+        int result = test_expression(arguments + 1, count - 1);
+        return result == 2 ? 2 : !result;
+    }
+    int result = -1;
+    if(count == 0){
+        result = 1;
+    }
+    else if(count == 1){
+        result = arguments[0][0] == '\0';
+    }
+    else if(count == 2){
+        result = test_unary(arguments[0], arguments[1]);
+    }
+    else if(count == 3){
+        result = test_binary(arguments[0], arguments[1], arguments[2]);
+    }
+    if(result < 0){
+        fprintf(stderr, "test: syntax error\n");
+        return 2;
+    }
+    return result;
+}
+
+int test_builtin(struct BuiltinCall *call){
+    /* test expr, or [ expr ] */
+    int count = 0;
+    while(call->arguments[count + 1] != NULL){
+        count++;
+    }
+    if(!strcmp(call->arguments[0], "[")){
+        if(count == 0 || strcmp(call->arguments[count], "]")){
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        count--;
+    }
+    return test_expression(call->arguments + 1, count);
+}
+
+bool sleep_accepts(char **arguments){
+    /* Plain decimal numbers with an optional s/m/h/d, infinity and the rest go to /bin/sleep */
+    if(arguments[1] == NULL){
+        return false;
+    }
+    for(int i = 1; arguments[i] != NULL; i++){
+        size_t digits = strspn(arguments[i], "0123456789.");
+        char *suffix = arguments[i] + digits;
+        if(digits == 0 || strchr(arguments[i], '.') != strrchr(arguments[i], '.') || (*suffix != '\0' && (suffix[1] != '\0' || !strchr("smhd", *suffix)))){
+            return false;
+        }
+    }
+    return true;
+}
+
+int sleep_builtin(struct BuiltinCall *call){
+    /* sleep seconds..., fractions and s/m/h/d suffixes allowed, the arguments add up */
+    double total = 0;
+    for(int i = 1; call->arguments[i] != NULL; i++){
+        char *suffix;
+        double amount = strtod(call->arguments[i], &suffix);
+        if(suffix == call->arguments[i] || amount < 0 || (*suffix != '\0' && (suffix[1] != '\0' || !strchr("smhd", *suffix)))){
+            fprintf(stderr, "sleep: invalid time interval\n");
+            return 1;
+        }
+        total += amount * (*suffix == 'm' ? 60 : *suffix == 'h' ? 3600 : *suffix == 'd' ? 86400 : 1);
+    }
+    if(call->arguments[1] == NULL){
+        fprintf(stderr, "sleep: missing operand\n");
+        return 1;
+    }
+    struct timespec remaining = { .tv_sec = (time_t)total, .tv_nsec = (long)((total - (time_t)total) * 1e9) };
+    if(interruptible){ //the same wait, but ^C ends it
+        struct pollfd fd = { .fd = interrupt_fd, .events = POLLIN };
+        long long deadline = monotonic_ns() + remaining.tv_sec * 1000000000LL + remaining.tv_nsec;
+        for(long long left; (left = deadline - monotonic_ns()) > 0; ){
+            struct timespec wait = { .tv_sec = left / 1000000000LL, .tv_nsec = left % 1000000000LL };
+            if(ppoll(&fd, 1, &wait, NULL) > 0){
+                return INTERRUPTED;
+            }
+        }
+        return 0;
+    }
+    while(nanosleep(&remaining, &remaining) != 0 && errno == EINTR){
+    }
+    return 0;
+}
+
+#define COPY_CHUNK (1 << 20) //bytes asked for per splice/sendfile/copy_file_range call
+#define COPY_BUFFER (128 * 1024) //the read/write fallback
+
+int copy_with_buffer(int in_fd, int out_fd){
+    /* The plain way, through user space, for fds the kernel won't copy between. 0 at EOF, 1 on an error */
+    char *buffer = malloc(COPY_BUFFER);
+    int exit_code = 0;
+    while(1){
+        if(!wait_readable(in_fd)){
+            exit_code = INTERRUPTED;
+            break;
+        }
+        ssize_t n = read(in_fd, buffer, COPY_BUFFER);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            exit_code = n < 0;
+            break;
+        }
+        if(write_all(out_fd, buffer, n)){
+            exit_code = 1;
+            break;
+        }
+    }
+    free(buffer);
+    return exit_code;
+}
+
+int copy_fd(int in_fd, int out_fd){
+    /* Copies in_fd to out_fd until EOF without the data passing through user space where possible:
+       splice when either side is a pipe, copy_file_range between regular files, sendfile from a file
+       to anything else (a terminal, a socket). Whatever the kernel refuses falls back to read/write,
+       and since every call moves the file offsets, the fallback picks up where the fast path stopped.
+       INTERRUPTED if ^C stops it */
+    struct stat in_info, out_info;
+    if(fstat(in_fd, &in_info) != 0 || fstat(out_fd, &out_info) != 0){
+        return copy_with_buffer(in_fd, out_fd);
+    }
+
+    enum { SPLICE, COPY_FILE_RANGE, SENDFILE } method;
+    if(S_ISFIFO(in_info.st_mode) || S_ISFIFO(out_info.st_mode)){
+        method = SPLICE;
+    }
+    else if(S_ISREG(in_info.st_mode) && S_ISREG(out_info.st_mode)){
+        method = COPY_FILE_RANGE;
+    }
+    else if(S_ISREG(in_info.st_mode)){
+        method = SENDFILE;
+    }
+    else{
+        return copy_with_buffer(in_fd, out_fd);
+    }
+
+    while(1){
+        if(!wait_readable(in_fd)){
+            return INTERRUPTED;
+        }
+        ssize_t n;
+        if(method == SPLICE){
+            n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        }
+        else if(method == COPY_FILE_RANGE){
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+        }
+        else{
+            n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+        }
+        if(n == 0){
+            return 0;
+        }
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EBADF || errno == EOPNOTSUPP){
+                return copy_with_buffer(in_fd, out_fd); //e.g. O_APPEND output, or a filesystem without support
+            }
+            return 1;
+        }
+    }
+}
+
+int copy_range(int in_fd, off_t offset, size_t length, int out_fd){
+    /* Copies length bytes of a file starting at offset, in the kernel when it can. 1 on an error */
+    while(length > 0){
+        ssize_t n = sendfile(out_fd, in_fd, &offset, length > COPY_CHUNK ? COPY_CHUNK : length);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0 && (errno == EINVAL || errno == ENOSYS)){ //e.g. O_APPEND output
+            char *buffer = malloc(COPY_BUFFER);
+            while(length > 0 && (n = pread(in_fd, buffer, length > COPY_BUFFER ? COPY_BUFFER : length, offset)) > 0){
+                if(write_all(out_fd, buffer, n)){
+                    break;
+                }
+                offset += n;
+                length -= n;
+            }
+            free(buffer);
+            return length > 0;
+        }
+        if(n <= 0){
+            return 1;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+bool cat_accepts(char **arguments){
+    /* Only file names and -, any option (-n, -A, --help...) goes to /bin/cat */
+    for(int i = 1; arguments[i] != NULL; i++){
+        if(arguments[i][0] == '-' && arguments[i][1] != '\0'){
+            return false;
+        }
+    }
+    return true;
+}
+
+int cat_builtin(struct BuiltinCall *call){
+    /* cat [file...], - or no files for stdin */
+    if(call->arguments[1] == NULL){
+        return copy_fd(call->in_fd, call->out_fd);
+    }
+    int exit_code = 0;
+    for(int i = 1; call->arguments[i] != NULL; i++){
+        int copied;
+        if(!strcmp(call->arguments[i], "-")){
+            copied = copy_fd(call->in_fd, call->out_fd);
+        }
+        else{
+            int fd = open(call->arguments[i], O_RDONLY | O_CLOEXEC);
+            if(fd < 0){
+                fprintf(stderr, "cat: cannot open %s\n", call->arguments[i]);
+                exit_code = 1;
+                continue;
+            }
+            copied = copy_fd(fd, call->out_fd);
+            close(fd);
+        }
+        if(copied == INTERRUPTED){
+            return INTERRUPTED;
+        }
+        exit_code |= copied;
+    }
+    return exit_code;
+}
+
+int tee_with_buffer(int in_fd, int out_fd, int *files, int num_files){
+    char *buffer = malloc(COPY_BUFFER);
+    int exit_code = 0;
+    while(1){
+        if(!wait_readable(in_fd)){
+            exit_code = INTERRUPTED;
+            break;
+        }
+        ssize_t n = read(in_fd, buffer, COPY_BUFFER);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            exit_code |= n < 0;
+            break;
+        }
+        for(int i = 0; i < num_files; i++){
+            exit_code |= write_all(files[i], buffer, n);
+        }
+        if(write_all(out_fd, buffer, n)){
+            exit_code = 1;
+            break; //nobody reads our output anymore, like tee getting SIGPIPE
+        }
+    }
+    free(buffer);
+    return exit_code;
+}
+
+bool tee_accepts(char **arguments){
+    /* A leading -a and file names, other options (-i, -p, --version...) go to /bin/tee */
+    int first = arguments[1] != NULL && !strcmp(arguments[1], "-a") ? 2 : 1;
+    for(int i = first; arguments[i - 1] != NULL && arguments[i] != NULL; i++){
+        if(arguments[i][0] == '-'){
+            return false;
+        }
+    }
+    return true;
+}
+
+int tee_builtin(struct BuiltinCall *call){
+    /* tee [-a] [file...]: stdin to stdout and to every file. Between two pipes the data is duplicated
+       in the kernel: tee(2) copies the input pipe into the output pipe without using it up, splice then
+       moves it into the first file and copy_file_range copies that part of the first file to the others */
+    char **names = call->arguments + 1;
+    bool append = false;
+    if(names[0] != NULL && !strcmp(names[0], "-a")){
+        append = true;
+        names++;
+    }
+
+    int num_files = 0;
+    int files[64];
+    int exit_code = 0;
+    for(int i = 0; names[i] != NULL; i++){
+        int flags = O_CREAT | O_CLOEXEC | (append ? O_WRONLY | O_APPEND : O_RDWR | O_TRUNC); //the first file is read back for the others
+        int fd = num_files < 64 ? open(names[i], flags, 0644) : -1;
+        if(fd < 0){
+            fprintf(stderr, "tee: cannot open %s\n", names[i]);
+            exit_code = 1;
+            continue;
+        }
+        files[num_files++] = fd;
+    }
+
+    struct stat in_info, out_info, file_info;
+    bool pipes = fstat(call->in_fd, &in_info) == 0 && S_ISFIFO(in_info.st_mode)
+              && fstat(call->out_fd, &out_info) == 0 && S_ISFIFO(out_info.st_mode);
+    bool regular = num_files > 0 && fstat(files[0], &file_info) == 0 && S_ISREG(file_info.st_mode); //the others are copied back out of it
+    int copied = 0;
+    if(num_files == 0){
+        copied = copy_fd(call->in_fd, call->out_fd);
+    }
+    else if(!pipes || append || !regular){ //splice and copy_file_range both refuse O_APPEND
+        copied = tee_with_buffer(call->in_fd, call->out_fd, files, num_files);
+    }
+    else{
+        while(1){
+            if(!wait_readable(call->in_fd)){
+                copied = INTERRUPTED;
+                break;
+            }
+            ssize_t n = tee(call->in_fd, call->out_fd, COPY_CHUNK, 0);
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            if(n < 0 && errno == EINVAL){
+                copied = tee_with_buffer(call->in_fd, call->out_fd, files, num_files);
+                break;
+            }
+            if(n <= 0){
+                exit_code |= n < 0;
+                break;
+            }
+
+            off_t start = lseek(files[0], 0, SEEK_CUR);
+            ssize_t left = n;
+            while(left > 0){ //take the n bytes out of the input pipe, into the first file
+                ssize_t moved = splice(call->in_fd, NULL, files[0], NULL, left, SPLICE_F_MOVE);
+                if(moved < 0 && errno == EINTR){
+                    continue;
+                }
+                if(moved <= 0){
+                    break;
+                }
+                left -= moved;
+            }
+            if(left > 0){
+                exit_code = 1;
+                break;
+            }
+            for(int i = 1; i < num_files; i++){
+                off_t offset = start;
+                ssize_t copy_left = n;
+                while(copy_left > 0){
+                    ssize_t written = copy_file_range(files[0], &offset, files[i], NULL, copy_left, 0);
+                    if(written <= 0){
+                        char *buffer = malloc(copy_left); //cross-device copy before 5.3, do it by hand
+                        ssize_t got = buffer != NULL ? pread(files[0], buffer, copy_left, offset) : -1;
+                        if(got <= 0 || write_all(files[i], buffer, got)){
+                            exit_code = 1;
+                            got = copy_left;
+                        }
+                        free(buffer);
+                        written = got;
+                        offset += got;
+                    }
+                    copy_left -= written;
+                }
+            }
+        }
+    }
+
+    for(int i = 0; i < num_files; i++){
+        close(files[i]);
+    }
+    return copied == INTERRUPTED ? INTERRUPTED : exit_code | copied;
+}
+
+/* parallel [-j N] [-u] command [args...]: runs the command once per line of stdin, with {} in the
+   arguments replaced by the line (or the line added at the end if there's no {}), N at a time.
+   The items are dealt round-robin onto one deque per worker; a worker takes from the front of its
+   own deque and when that's empty steals from the back of someone else's, so a few slow items
+   don't leave the other workers idle. Output comes out in input order unless -u is given */
+
+struct WorkDeque {
+    pthread_mutex_t lock;
+    int *items; //item indexes, front to back
+    int front;
+    int back; //one past the last
+};
+
+struct Parallel {
+    char **template;
+    char *path; //the command, resolved once before the workers start (NULL: argv[0] has a {}, search per item)
+    char **items;
+    int num_items;
+    int *exit_codes;
+    struct WorkDeque *deques;
+    int num_workers;
+    bool ordered;
+    int out_fd;
+    bool interruptible; //what the workers check, they're threads of a foreground builtin
+    bool interrupted; //^C: the items nobody took yet are skipped
+
+    pthread_mutex_t output_lock; //ordered output: item outputs wait in memfds until everything before them is out
+    int *outputs;
+    bool *finished;
+    int next_output;
+};
+
+bool work_take(struct Parallel *parallel, int worker, int *item){
+    /* The next item for this worker: its own oldest one, or else the newest one of another worker */
+    for(int i = 0; i < parallel->num_workers; i++){
+        struct WorkDeque *deque = &parallel->deques[(worker + i) % parallel->num_workers];
+        pthread_mutex_lock(&deque->lock);
+        bool found = deque->front < deque->back;
+        if(found){
+            *item = i == 0 ? deque->items[deque->front++] : deque->items[--deque->back];
+        }
+        pthread_mutex_unlock(&deque->lock);
+        if(found){
+            return true;
+        }
+    }
+    return false; //every item is taken, there's never more of them
+}
+
+char *substitute(const char *argument, const char *item, bool *used){
+    /* argument with every {} replaced by item */
+    size_t item_length = strlen(item);
+    size_t length = strlen(argument);
+    char *result = malloc(length + 1);
+    size_t size = 0;
+    for(const char *c = argument; *c != '\0'; c++){
+        if(c[0] == '{' && c[1] == '}'){
+            length += item_length;
+            result = realloc(result, length + 1);
+            memcpy(result + size, item, item_length);
+            size += item_length;
+            c++;
+            *used = true;
+            continue;
+        }
+        result[size++] = *c;
+    }
+    result[size] = '\0';
+    return result;
+}
+
+int parallel_run(struct Parallel *parallel, int item, int out_fd){
+    /* Runs one item to completion, returns its exit code */
+    int count = 0;
+    while(parallel->template[count] != NULL){
+        count++;
+    }
+    char **arguments = calloc(count + 2, sizeof(char *));
+    bool used = false;
+    for(int i = 0; i < count; i++){
+        arguments[i] = substitute(parallel->template[i], parallel->items[item], &used);
+    }
+    if(!used){
+        arguments[count] = strdup(parallel->items[item]); //like xargs, the item goes at the end
+    }
+
+    TRACE(TRACE_SPAWN, 0, arguments[0]);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0); //the items are on our stdin
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    posix_spawnattr_t attributes;
+    spawn_attributes_init(&attributes);
+
+    pid_t pid;
+    struct CommandStats *stats = stats_for(arguments[0]);
+    long long before = monotonic_ns();
+    int error = parallel->path != NULL ? posix_spawn(&pid, parallel->path, &actions, &attributes, arguments, environ)
+                                       : posix_spawnp(&pid, arguments[0], &actions, &attributes, arguments, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+
+    int exit_code = 1;
+    if(error != 0){
+        stats_count(error == EAGAIN || error == ENOMEM ? &stats->fork_failures : &stats->exec_failures);
+        fprintf(stderr, "%s", COMMAND_NOT_FOUND);
+    }
+    else{
+        stats_time(stats, STATS_SPAWN, monotonic_ns() - before);
+        stats_count(&stats->runs);
+        TRACE(TRACE_EXEC, pid, arguments[0]);
+        int status;
+        pid_t reaped;
+        while((reaped = waitpid(pid, &status, 0)) < 0 && errno == EINTR){
+        }
+        stats_time(stats, STATS_RUNTIME, monotonic_ns() - before);
+        stats_time(stats, STATS_REAP, 0); //this worker was waiting right there
+        if(reaped != pid){
+            fprintf(stderr, "parallel: lost track of a child\n"); //status was never filled in
+        }
+        else{
+            exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+        if(exit_code != 0){
+            stats_count(&stats->nonzero_exits);
+        }
+        if(trace.enabled){
+            char code[16];
+            snprintf(code, sizeof(code), "%d", exit_code);
+            trace_record(TRACE_REAP, pid, code);
+        }
+    }
+
+    for(int i = 0; arguments[i] != NULL; i++){
+        free(arguments[i]);
+    }
+    free(arguments);
+    return exit_code;
+}
+
+struct Worker {
+    pthread_t thread;
+    struct Parallel *parallel;
+    int id; //also which deque is its own
+};
+
+void *parallel_worker(void *data){
+    struct Parallel *parallel = ((struct Worker *)data)->parallel;
+    int worker = ((struct Worker *)data)->id;
+    interruptible = parallel->interruptible;
+    int item;
+    while(work_take(parallel, worker, &item)){
+        if(interrupt_pending()){
+            parallel->interrupted = true;
+            break;
+        }
+        if(!parallel->ordered){
+            parallel->exit_codes[item] = parallel_run(parallel, item, parallel->out_fd);
+            continue;
+        }
+
+        int output = memfd_create("parallel", MFD_CLOEXEC);
+        parallel->exit_codes[item] = parallel_run(parallel, item, output >= 0 ? output : parallel->out_fd);
+
+        pthread_mutex_lock(&parallel->output_lock);
+        parallel->outputs[item] = output;
+        parallel->finished[item] = true;
+        while(parallel->next_output < parallel->num_items && parallel->finished[parallel->next_output]){
+            int fd = parallel->outputs[parallel->next_output++];
+            if(fd >= 0){
+                copy_range(fd, 0, lseek(fd, 0, SEEK_END), parallel->out_fd);
+                close(fd);
+            }
+        }
+        pthread_mutex_unlock(&parallel->output_lock);
+    }
+    return NULL;
+}
+
+int parallel_builtin(struct BuiltinCall *call){
+    struct Parallel parallel = { .ordered = true, .out_fd = call->out_fd, .interruptible = interruptible };
+    parallel.num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    char **arguments = call->arguments + 1;
+    while(arguments[0] != NULL && arguments[0][0] == '-'){
+        if(!strcmp(arguments[0], "-j") && arguments[1] != NULL && atoi(arguments[1]) > 0){
+            parallel.num_workers = atoi(arguments[1]);
+            arguments += 2;
+        }
+        else if(!strcmp(arguments[0], "-u")){
+            parallel.ordered = false;
+            arguments++;
+        }
+        else if(!strcmp(arguments[0], "-k")){
+            arguments++; //ordered already
+        }
+        else{
+            break;
+        }
+    }
+    if(arguments[0] == NULL){
+        fprintf(stderr, "parallel: missing command\n");
+        return 2;
+    }
+    parallel.template = arguments;
+    parallel.path = strstr(arguments[0], "{}") ? NULL : strchr(arguments[0], '/') ? strdup(arguments[0]) : search_path(arguments[0]);
+    if(!strstr(arguments[0], "{}") && parallel.path == NULL){
+        fprintf(stderr, "%s", COMMAND_NOT_FOUND);
+        return 1;
+    }
+
+    /* Every item first, one per line */
+    struct Output input = { 0 };
+    char buffer[COPY_BUFFER / 16];
+    ssize_t n;
+    while(wait_readable(call->in_fd) && (n = read(call->in_fd, buffer, sizeof(buffer))) != 0){
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0){
+            break;
+        }
+        output_append(&input, buffer, n);
+    }
+    if(interrupt_pending()){
+        free(input.data);
+        free(parallel.path);
+        return INTERRUPTED;
+    }
+    output_append(&input, "", 1);
+    int capacity = 0;
+    for(char *line = input.data; line < input.data + input.length - 1; ){
+        char *end = strchr(line, '\n');
+        if(end != NULL){
+            *end = '\0';
+        }
+        if(*line != '\0'){ //blank lines aren't items
+            if(parallel.num_items == capacity){
+                capacity = capacity ? capacity * 2 : 64;
+                parallel.items = realloc(parallel.items, capacity * sizeof(char *));
+            }
+            parallel.items[parallel.num_items++] = line;
+        }
+        if(end == NULL){
+            break;
+        }
+        line = end + 1;
+    }
+
+    if(parallel.num_workers > parallel.num_items){
+        parallel.num_workers = parallel.num_items > 0 ? parallel.num_items : 1;
+    }
+    parallel.exit_codes = calloc(parallel.num_items, sizeof(int));
+    parallel.outputs = calloc(parallel.num_items, sizeof(int));
+    parallel.finished = calloc(parallel.num_items, sizeof(bool));
+    pthread_mutex_init(&parallel.output_lock, NULL);
+    parallel.deques = calloc(parallel.num_workers, sizeof(struct WorkDeque));
+    for(int w = 0; w < parallel.num_workers; w++){
+        struct WorkDeque *deque = &parallel.deques[w];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->items = malloc((parallel.num_items / parallel.num_workers + 1) * sizeof(int));
+        for(int item = w; item < parallel.num_items; item += parallel.num_workers){ //dealt round-robin
+            deque->items[deque->back++] = item;
+        }
+    }
+
+    struct Worker *workers = malloc(parallel.num_workers * sizeof(struct Worker));
+    for(int w = 0; w < parallel.num_workers; w++){
+        workers[w].parallel = &parallel;
+        workers[w].id = w;
+        pthread_create(&workers[w].thread, NULL, parallel_worker, &workers[w]);
+    }
+    for(int w = 0; w < parallel.num_workers; w++){
+        pthread_join(workers[w].thread, NULL);
+    }
+
+    /* The exit codes of every item, in input order, in the same form as the completion line */
+    int failed = 0;
+    struct Output summary = { 0 };
+    output_append(&summary, "+ parallel ", 11);
+    for(int i = 0; i < parallel.num_items; i++){
+        char code[16];
+        int length = snprintf(code, sizeof(code), "[%d]", parallel.exit_codes[i]);
+        output_append(&summary, code, length);
+        failed += parallel.exit_codes[i] != 0;
+    }
+    output_append(&summary, "\n", 1);
+    if(quiet){
+        free(summary.data); //a completion line like the others
+    }
+    else{
+        output_write(&summary, STDERR_FILENO);
+    }
+
+    for(int i = parallel.next_output; i < parallel.num_items; i++){ //after ^C, outputs stuck behind a skipped item
+        if(parallel.finished[i] && parallel.outputs[i] >= 0){
+            close(parallel.outputs[i]);
+        }
+    }
+    for(int w = 0; w < parallel.num_workers; w++){
+        free(parallel.deques[w].items);
+    }
+    free(parallel.deques);
+    free(workers);
+    free(parallel.exit_codes);
+    free(parallel.outputs);
+    free(parallel.finished);
+    free(parallel.items);
+    free(parallel.path);
+    free(input.data);
+    if(parallel.interrupted){
+        return INTERRUPTED;
+    }
+    return failed > 101 ? 101 : failed; //how many items failed, like GNU parallel
+}
+
+bool make_directories(char *path){
+    /* mkdir -p */
+    for(char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')){
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+/* History: every line typed at the terminal goes into a ring file mapped into memory, shared by all
+   sessions. The file is a HistoryHeader and then the ring, where positions only ever grow and wrap
+   around the ring modulo its capacity. An entry is a HistoryEntry, the line, and padding to 8 bytes;
+   one that doesn't fit before the end of the ring leaves a wrap marker (or a gap too small for one)
+   and starts over at 0. Appends take flock, readers don't: an entry is only believed once its
+   position field, written last, matches where it was found, and while it's at or past the tail.
+   Searches go through buckets of entry ids: by the first two bytes of the line for !prefix, and by
+   every three bytes in it for history -s. A bucket is only a shortlist, each entry is checked */
+#define HISTORY_MAGIC 0x3179726f74736968ULL //"history1"
+#define HISTORY_BUCKETS (1 << 14)
+
+struct HistoryHeader {
+    unsigned long long magic;
+    unsigned long long capacity; //bytes in the ring
+    unsigned long long head; //position the next entry goes to
+    unsigned long long tail; //position of the oldest entry that's still whole
+    unsigned long long next_number; //what the next entry is called in history and !N
+};
+
+struct HistoryEntry {
+    unsigned long long position; //where it was written, so it can't be mistaken for a newer one
+    unsigned long long number;
+    unsigned int length; //of the line, which follows
+    unsigned int wrap; //a marker: the rest of the ring is unused, go on at 0
+};
+
+struct HistoryPostings {
+    unsigned int *ids; //index position plus History.dropped, oldest first
+    size_t count;
+    size_t capacity;
+};
+
+struct History {
+    int fd; //-1 until the first line needs it, -2 when there's no usable history file
+    struct HistoryHeader *header;
+    char *ring;
+    pthread_mutex_t lock; //the mapping and the index, a history builtin may run on a thread while main adds a line
+    unsigned long long *index; //positions of the entries, oldest first, found by history_catch_up
+    size_t first; //index entries before this one were overwritten
+    size_t count;
+    size_t capacity;
+    unsigned long long indexed; //how far history_catch_up got
+    unsigned int dropped; //index entries moved out of the front so far, ids below this are gone
+    struct HistoryPostings *prefixes; //entries by their first two bytes
+    struct HistoryPostings *trigrams; //entries by each three bytes in them
+};
+
+struct History history = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+unsigned long long history_entry_size(unsigned int length){
+    return (sizeof(struct HistoryEntry) + length + 7) & ~7ULL;
+}
+
+struct HistoryEntry *history_at(unsigned long long position){
+    return (struct HistoryEntry *)(history.ring + position % history.header->capacity);
+}
+
+unsigned long long history_next(unsigned long long position){
+    /* The position after the entry (or marker) at position */
+    unsigned long long left = history.header->capacity - position % history.header->capacity;
+    if(left < sizeof(struct HistoryEntry) || history_at(position)->wrap){
+        return position + left;
+    }
+    return position + history_entry_size(history_at(position)->length);
+}
+
+bool history_map(void){
+    /* Maps the history file, making it first if it's new. Called with the lock held */
+    history.fd = -2;
+    if(history_path[0] == '\0'){
+        return false;
+    }
+    char *slash = strrchr(history_path, '/');
+    if(slash != NULL && slash != history_path){
+        *slash = '\0';
+        make_directories(history_path);
+        *slash = '/';
+    }
+    int fd = open(history_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd < 0){
+        return false;
+    }
+    flock(fd, LOCK_EX); //two sessions starting at once must not both set it up
+    struct stat info;
+    fstat(fd, &info);
+    if(info.st_size == 0){
+        unsigned long long capacity = history_size > 4096 ? history_size & ~7ULL : 4096;
+        struct HistoryHeader header = { .magic = HISTORY_MAGIC, .capacity = capacity, .next_number = 1 };
+        if(ftruncate(fd, sizeof(header) + capacity) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)){
+            flock(fd, LOCK_UN);
+            close(fd);
+            return false;
+        }
+        info.st_size = sizeof(header) + capacity;
+    }
+    flock(fd, LOCK_UN);
+    void *map = (size_t)info.st_size > sizeof(struct HistoryHeader) ? mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if(map == MAP_FAILED){
+        close(fd);
+        return false;
+    }
+    history.header = map;
+    if(history.header->magic != HISTORY_MAGIC || history.header->capacity != info.st_size - sizeof(struct HistoryHeader)){
+        fprintf(stderr, "Error: history file is damaged\n");
+        munmap(map, info.st_size);
+        close(fd);
+        return false;
+    }
+    history.ring = (char *)map + sizeof(struct HistoryHeader);
+    history.fd = fd;
+    return true;
+}
+
+bool history_open(void){
+    /* Maps the history file the first time something needs it, so lines that never touch history
+       (scripts, -c) don't pay for it. Main and a history builtin's thread may get here at once */
+    pthread_mutex_lock(&history.lock);
+    bool open = history.fd == -1 ? history_map() : history.fd >= 0;
+    pthread_mutex_unlock(&history.lock);
+    return open;
+}
+
+void history_add(const char *line){
+    /* Appends a line (without its newline), dropping the oldest ones it overwrites */
+    size_t length = strlen(line);
+    if(line[strspn(line, " \t")] == '\0' || !history_open()){
+        return;
+    }
+    struct HistoryHeader *header = history.header;
+    unsigned long long size = history_entry_size(length);
+    if(size > header->capacity / 4){
+        return; //a line that would wipe out most of the history isn't worth keeping
+    }
+
+    flock(history.fd, LOCK_EX);
+    unsigned long long head = header->head;
+    unsigned long long left = header->capacity - head % header->capacity;
+    unsigned long long start = left < size ? head + left : head; //doesn't fit before the end, so it goes at 0
+    while(header->tail < head && header->tail + header->capacity < start + size){
+        header->tail = history_next(header->tail); //the oldest entries that are about to be overwritten
+    }
+    if(header->tail < head && header->tail + header->capacity < start + size){
+        header->tail = start; //walked into something that isn't an entry
+    }
+    if(start != head && left >= sizeof(struct HistoryEntry)){
+        *history_at(head) = (struct HistoryEntry){ .position = head, .wrap = 1 };
+    }
+    struct HistoryEntry *entry = history_at(start);
+    memcpy(entry + 1, line, length);
+    entry->number = header->next_number++;
+    entry->length = length;
+    entry->wrap = 0;
+    __atomic_store_n(&entry->position, start, __ATOMIC_RELEASE); //only now is it an entry
+    if(header->tail == head && head == 0){
+        header->tail = start;
+    }
+    __atomic_store_n(&header->head, start + size, __ATOMIC_RELEASE);
+    flock(history.fd, LOCK_UN);
+}
+
+unsigned int history_bucket(const char *bytes, size_t length){
+    unsigned int hash = 2166136261u; //FNV-1a
+    for(size_t i = 0; i < length; i++){
+        hash = (hash ^ (unsigned char)bytes[i]) * 16777619u;
+    }
+    return hash & (HISTORY_BUCKETS - 1);
+}
+
+void history_post(struct HistoryPostings *postings, unsigned int id){
+    if(postings->count > 0 && postings->ids[postings->count - 1] == id){
+        return; //the same bytes twice in one line
+    }
+    if(postings->count == postings->capacity){
+        postings->capacity = postings->capacity ? postings->capacity * 2 : 4;
+        postings->ids = realloc(postings->ids, postings->capacity * sizeof(*postings->ids));
+    }
+    postings->ids[postings->count++] = id;
+}
+
+void history_post_entry(struct HistoryEntry *entry, unsigned int id){
+    const char *text = (const char *)(entry + 1);
+    if(entry->length >= 2){
+        history_post(&history.prefixes[history_bucket(text, 2)], id);
+    }
+    for(size_t i = 0; i + 3 <= entry->length; i++){
+        history_post(&history.trigrams[history_bucket(text + i, 3)], id);
+    }
+}
+
+void history_prune(struct HistoryPostings *table){
+    /* Drops the ids of entries that are gone, once the index itself has dropped them */
+    for(int i = 0; i < HISTORY_BUCKETS; i++){
+        struct HistoryPostings *postings = &table[i];
+        size_t gone = 0;
+        while(gone < postings->count && postings->ids[gone] < history.dropped){
+            gone++;
+        }
+        postings->count -= gone;
+        memmove(postings->ids, postings->ids + gone, postings->count * sizeof(*postings->ids));
+    }
+}
+
+void history_catch_up(void){
+    /* Brings the index up to the head of the file, which other sessions may have moved. Called with
+       the lock held */
+    unsigned long long head = __atomic_load_n(&history.header->head, __ATOMIC_ACQUIRE);
+    unsigned long long tail = __atomic_load_n(&history.header->tail, __ATOMIC_ACQUIRE);
+    while(history.first < history.count && history.index[history.first] < tail){
+        history.first++; //overwritten since the last time
+    }
+    if(history.prefixes == NULL){
+        history.prefixes = calloc(HISTORY_BUCKETS, sizeof(struct HistoryPostings));
+        history.trigrams = calloc(HISTORY_BUCKETS, sizeof(struct HistoryPostings));
+    }
+    if(history.first > history.count / 2){ //the buckets are pruned at the same time, so it stays O(1) per entry
+        history.count -= history.first;
+        memmove(history.index, history.index + history.first, history.count * sizeof(*history.index));
+        history.dropped += history.first;
+        history.first = 0;
+        history_prune(history.prefixes);
+        history_prune(history.trigrams);
+    }
+    unsigned long long position = history.indexed < tail ? tail : history.indexed;
+    while(position < head){
+        struct HistoryEntry *entry = history_at(position);
+        unsigned long long left = history.header->capacity - position % history.header->capacity;
+        if(left >= sizeof(struct HistoryEntry) && !entry->wrap){
+            if(__atomic_load_n(&entry->position, __ATOMIC_ACQUIRE) != position){
+                break; //not written yet, or not an entry: try again next time
+            }
+            if(history.count == history.capacity){
+                history.capacity = history.capacity * 2 + 1024;
+                history.index = realloc(history.index, history.capacity * sizeof(*history.index));
+            }
+            history_post_entry(entry, history.dropped + history.count);
+            history.index[history.count++] = position;
+        }
+        position = history_next(position);
+    }
+    history.indexed = position;
+}
+
+struct HistoryEntry *history_entry(size_t i){
+    /* The i-th entry of the index, or NULL if another session has overwritten it since */
+    struct HistoryEntry *entry = history_at(history.index[i]);
+    if(history.index[i] < __atomic_load_n(&history.header->tail, __ATOMIC_ACQUIRE) || entry->position != history.index[i]){
+        return NULL;
+    }
+    return entry;
+}
+
+struct HistoryEntry *history_posted(unsigned int id){
+    /* The entry an id in a bucket stands for, or NULL if it's gone */
+    if(id < history.dropped + history.first){
+        return NULL;
+    }
+    return history_entry(id - history.dropped);
+}
+
+struct HistoryEntry *history_by_number(unsigned long long number){
+    /* Numbers grow along the index, so it's a binary search. Called with the lock held */
+    size_t low = history.first;
+    size_t high = history.count;
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+        struct HistoryEntry *entry = history_entry(middle);
+        if(entry == NULL || entry->number < number){ //overwritten ones are the oldest
+            low = middle + 1;
+        }
+        else if(entry->number > number){
+            high = middle;
+        }
+        else{
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+struct HistoryEntry *history_by_prefix(const char *prefix, size_t length){
+    /* The newest entry starting with prefix. Called with the lock held */
+    if(length >= 2){
+        struct HistoryPostings *postings = &history.prefixes[history_bucket(prefix, 2)];
+        for(size_t i = postings->count; i > 0; i--){
+            struct HistoryEntry *entry = history_posted(postings->ids[i - 1]);
+            if(entry == NULL){
+                break; //everything older is gone too
+            }
+            if(entry->length >= length && !memcmp(entry + 1, prefix, length)){
+                return entry;
+            }
+        }
+        return NULL;
+    }
+    for(size_t i = history.count; i > history.first; i--){ //one byte: the newest lines nearly always have it
+        struct HistoryEntry *entry = history_entry(i - 1);
+        if(entry == NULL){
+            break;
+        }
+        if(entry->length >= length && !memcmp(entry + 1, prefix, length)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+char *history_expand(const char *line){
+    /* !! is the last line, !N line N, !prefix the newest line starting with prefix. The rest of
+       the line is kept, so "!gre -c" is the last grep with -c added. NULL when there's no such line */
+    const char *bang = line + strspn(line, " \t");
+    const char *designator = bang + 1;
+    size_t designator_length = strcspn(designator, " \t");
+    const char *rest = designator + designator_length;
+    if(designator_length == 0 || !history_open()){
+        return NULL;
+    }
+    char *end;
+    unsigned long long number = strtoull(designator, &end, 10);
+    bool by_number = end == rest;
+
+    char *expanded = NULL;
+    pthread_mutex_lock(&history.lock);
+    history_catch_up();
+    struct HistoryEntry *entry;
+    if(by_number){
+        entry = history_by_number(number);
+    }
+    else if(designator[0] == '!' && designator_length == 1){
+        entry = history.count > history.first ? history_entry(history.count - 1) : NULL;
+    }
+    else{
+        entry = history_by_prefix(designator, designator_length);
+    }
+    if(entry != NULL){
+        size_t rest_length = strlen(rest);
+        expanded = malloc(entry->length + rest_length + 1);
+        memcpy(expanded, entry + 1, entry->length);
+        memcpy(expanded + entry->length, rest, rest_length + 1);
+    }
+    pthread_mutex_unlock(&history.lock);
+    return expanded;
+}
+
+void history_print(struct Output *output, struct HistoryEntry *entry){
+    char number[32];
+    int number_length = snprintf(number, sizeof(number), "%5llu  ", entry->number);
+    output_append(output, number, number_length);
+    output_append(output, (const char *)(entry + 1), entry->length);
+    output_append(output, "\n", 1);
+}
+
+int history_builtin(struct BuiltinCall *call){
+    /* history: every line, numbered. history N: the last N. history -s text: the lines that contain text */
+    char *pattern = NULL;
+    size_t last = (size_t)-1;
+    if(call->arguments[1] != NULL && !strcmp(call->arguments[1], "-s")){
+        pattern = call->arguments[2];
+        if(pattern == NULL){
+            fprintf(stderr, "Error: history -s needs a pattern\n");
+            return 1;
+        }
+    }
+    else if(call->arguments[1] != NULL){
+        char *end;
+        last = strtoul(call->arguments[1], &end, 10);
+        if(*end != '\0'){
+            fprintf(stderr, "Error: invalid history count\n");
+            return 1;
+        }
+    }
+    if(!history_open()){
+        return 0; //no history file: nothing has been kept
+    }
+
+    struct Output output = { 0 };
+    size_t pattern_length = pattern ? strlen(pattern) : 0;
+    pthread_mutex_lock(&history.lock);
+    history_catch_up();
+    if(pattern_length >= 3){ //only the lines in the bucket of its rarest three bytes can have it
+        struct HistoryPostings *postings = &history.trigrams[history_bucket(pattern, 3)];
+        for(size_t i = 1; i + 3 <= pattern_length; i++){
+            struct HistoryPostings *candidate = &history.trigrams[history_bucket(pattern + i, 3)];
+            if(candidate->count < postings->count){
+                postings = candidate;
+            }
+        }
+        for(size_t i = 0; i < postings->count; i++){
+            struct HistoryEntry *entry = history_posted(postings->ids[i]);
+            if(entry != NULL && memmem(entry + 1, entry->length, pattern, pattern_length) != NULL){
+                history_print(&output, entry);
+            }
+        }
+    }
+    else{
+        size_t from = history.count - history.first > last ? history.count - last : history.first;
+        for(size_t i = from; i < history.count; i++){
+            struct HistoryEntry *entry = history_entry(i);
+            if(entry == NULL){
+                continue; //overwritten while we were looking
+            }
+            if(pattern != NULL && memmem(entry + 1, entry->length, pattern, pattern_length) == NULL){
+                continue;
+            }
+            history_print(&output, entry);
+        }
+    }
+    pthread_mutex_unlock(&history.lock);
+    return output_write(&output, call->out_fd);
+}
+
+unsigned long long histogram_percentile(struct Histogram *histogram, double fraction){
+    /* The value fraction of the recorded ones are at or under, within a bucket */
+    unsigned long long total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    unsigned long long rank = (unsigned long long)(fraction * total + 0.999999);
+    unsigned long long seen = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS && total > 0; i++){
+        seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if(seen >= rank){
+            unsigned long long value = histogram_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void output_duration(struct Output *output, unsigned long long nanoseconds){
+    /* Right-aligned in 10 columns, in whatever unit keeps it short */
+    char text[32];
+    if(nanoseconds < 1000000){
+        snprintf(text, sizeof(text), "%10.1fus", nanoseconds / 1e3);
+    }
+    else if(nanoseconds < 1000000000){
+        snprintf(text, sizeof(text), "%10.1fms", nanoseconds / 1e6);
+    }
+    else{
+        snprintf(text, sizeof(text), "%10.2fs ", nanoseconds / 1e9);
+    }
+    output_append(output, text, strlen(text));
+}
+
+void output_stats_json(struct Output *output, struct CommandStats *stats){
+    char text[256];
+    output_append(output, "{\"command\":\"", 12);
+    for(const char *c = stats->name; *c != '\0'; c++){
+        if(*c == '"' || *c == '\\'){
+            output_append(output, "\\", 1);
+        }
+        if((unsigned char)*c >= 0x20){
+            output_append(output, c, 1);
+        }
+    }
+    int length = snprintf(text, sizeof(text), "\",\"runs\":%llu,\"nonzero_exits\":%llu,\"exec_failures\":%llu,\"fork_failures\":%llu",
+                          stats->runs, stats->nonzero_exits, stats->exec_failures, stats->fork_failures);
+    output_append(output, text, length);
+    for(int timer = 0; timer < STATS_TIMERS; timer++){
+        struct Histogram *histogram = &stats->timers[timer];
+        length = snprintf(text, sizeof(text), ",\"%s_ns\":{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+                          stats_timer_names[timer], histogram->total, histogram_percentile(histogram, 0.5),
+                          histogram_percentile(histogram, 0.9), histogram_percentile(histogram, 0.99), histogram->max);
+        output_append(output, text, length);
+    }
+    output_append(output, "}\n", 2);
+}
+
+int stats_builtin(struct BuiltinCall *call){
+    /* stats: a table of every command run so far, stats -j: the same as one JSON object per command,
+       stats reset: start counting again */
+    char *option = call->arguments[1];
+    if(option != NULL && !strcmp(option, "reset")){
+        for(int i = 0; i <= STATS_COMMANDS; i++){
+            struct CommandStats *stats = i < STATS_COMMANDS ? &command_stats[i] : &other_stats;
+            size_t numbers = offsetof(struct CommandStats, runs); //the slot keeps its name
+            memset((char *)stats + numbers, 0, sizeof(*stats) - numbers);
+        }
+        return 0;
+    }
+    bool json = option != NULL && !strcmp(option, "-j");
+    if(option != NULL && !json){
+        fprintf(stderr, "Error: invalid stats option\n");
+        return 1;
+    }
+
+    struct Output output = { 0 };
+    char text[256];
+    if(!json){
+        int length = snprintf(text, sizeof(text), "%-20s %7s %7s %8s %7s %12s %12s %12s %12s %12s %12s\n", "command", "runs",
+                              "nonzero", "notfound", "nofork", "spawn p50", "spawn p99", "run p50", "run p99", "reap p50", "reap p99");
+        output_append(&output, text, length);
+    }
+    for(int i = 0; i <= STATS_COMMANDS; i++){
+        struct CommandStats *stats = i < STATS_COMMANDS ? &command_stats[i] : &other_stats;
+        if(!__atomic_load_n(&stats->ready, __ATOMIC_ACQUIRE) || stats->runs + stats->exec_failures + stats->fork_failures == 0){
+            continue;
+        }
+        if(json){
+            output_stats_json(&output, stats);
+            continue;
+        }
+        int length = snprintf(text, sizeof(text), "%-20s %7llu %7llu %8llu %7llu ", stats->name, stats->runs,
+                              stats->nonzero_exits, stats->exec_failures, stats->fork_failures);
+        output_append(&output, text, length);
+        for(int timer = 0; timer < STATS_TIMERS; timer++){
+            output_duration(&output, histogram_percentile(&stats->timers[timer], 0.5));
+            output_duration(&output, histogram_percentile(&stats->timers[timer], 0.99));
+        }
+        output_append(&output, "\n", 1);
+    }
+    return output_write(&output, call->out_fd);
+}
+
+/* The builtin registry, a perfect hash: every name lands in its own slot of BUILTIN_SLOTS by
+   builtin_hash, so a lookup is one hash and one strcmp. Adding a builtin means finding it an
+   empty slot (or new multipliers that keep every name apart) */
+#define BUILTIN_SLOTS 64
+
+unsigned int builtin_hash(const char *name, size_t length){
+    return (length + (unsigned char)name[0] + 6 * (unsigned char)name[length - 1]) & (BUILTIN_SLOTS - 1);
+}
+
+const struct Builtin builtins[BUILTIN_SLOTS] = {
+    [0] = { "parallel", parallel_builtin, false },
+    [3] = { "echo", echo_builtin, false, echo_accepts },
+    [5] = { "history", history_builtin, false },
+    [9] = { "false", false_builtin, false },
+    [11] = { "pwd", pwd_builtin, false },
+    [21] = { "tee", tee_builtin, false, tee_accepts },
+    [22] = { "true", true_builtin, false },
+    [24] = { "sleep", sleep_builtin, false, sleep_accepts },
+    [26] = { "printf", printf_builtin, false, printf_accepts },
+    [28] = { "hash", hash_builtin, true },
+    [30] = { "cat", cat_builtin, false, cat_accepts },
+    [32] = { "jobs", jobs_builtin, true },
+    [33] = { "exit", exit_builtin, true },
+    [35] = { "export", export_builtin, true },
+    [42] = { "stats", stats_builtin, false },
+    [48] = { "test", test_builtin, false, test_accepts },
+    [50] = { "unset", unset_builtin, true },
+    [51] = { "wait", wait_builtin, true },
+    [61] = { "cd", cd_builtin, true },
+    [62] = { "[", test_builtin, false, test_accepts },
+};
+
+const struct Builtin *builtin_lookup(const char *name){
+    size_t length = strlen(name);
+    if(length == 0){
+        return NULL;
+    }
+    const struct Builtin *builtin = &builtins[builtin_hash(name, length)];
+    if(builtin->name == NULL || strcmp(builtin->name, name)){
+        return NULL;
+    }
+    return builtin;
+}
+
+const struct Builtin *builtin_command(char **arguments){
+    /* The builtin that runs this command, NULL if a program does: it isn't a builtin, or it is but
+       the arguments ask for something only the real program implements */
+    const struct Builtin *builtin = builtin_lookup(arguments[0]);
+    if(builtin != NULL && builtin->accepts != NULL && !builtin->accepts(arguments)){
+        return NULL;
+    }
+    return builtin;
+}
+
+void *builtin_thread(void *data){
+    /* One builtin stage of a pipeline or background job. Hands itself back to the main thread when done */
+    struct BuiltinStage *stage = data;
+    interruptible = stage->interruptible;
+    struct BuiltinCall call = {
+        .arguments = stage->arguments,
+        .in_fd = stage->in_fd >= 0 ? stage->in_fd : STDIN_FILENO,
+        .out_fd = stage->out_fd >= 0 ? stage->out_fd : STDOUT_FILENO,
+    };
+    stage->exit_code = stage->builtin->run(&call);
+    getrusage(RUSAGE_THREAD, &stage->usage);
+    if(stage->in_fd >= 0){
+        close(stage->in_fd);
+    }
+    if(stage->out_fd >= 0){
+        close(stage->out_fd); //the next stage sees EOF now
+    }
+
+    struct JobTable *table = stage->table;
+    pthread_mutex_lock(&table->builtin_lock);
+    stage->next_done = table->builtin_done;
+    table->builtin_done = stage;
+    pthread_mutex_unlock(&table->builtin_lock);
+    uint64_t one = 1;
+    if(write(table->builtin_event_fd, &one, sizeof(one)) < 0){
+        //can only fail if the counter overflows, and the main thread drains it long before that
+    }
+    return NULL;
+}
+
+char **copy_arguments(char **arguments){
+    /* One allocation holding the pointer array and the strings after it */
+    int count = 0;
+    size_t bytes = 0;
+    for(; arguments[count] != NULL; count++){
+        bytes += strlen(arguments[count]) + 1;
+    }
+    char **copy = malloc((count + 1) * sizeof(char *) + bytes);
+    char *strings = (char *)(copy + count + 1);
+    for(int i = 0; i < count; i++){
+        size_t length = strlen(arguments[i]) + 1;
+        memcpy(strings, arguments[i], length);
+        copy[i] = strings;
+        strings += length;
+    }
+    copy[count] = NULL;
+    return copy;
+}
+
+void run_builtin_stage(struct JobTable *table, struct Job *job, int stage, const struct Builtin *builtin,
+                       struct Command *command, int in_fd, int out_fd, bool on_thread){
+    /* Runs a builtin as one stage of a job without a child process. A lone foreground builtin runs right
+       here, unless the shell is interactive: ^C can only stop a builtin the event loop keeps running
+       beside. In a pipeline or in the background it gets a thread with its own copies of in_fd/out_fd */
+    char **arguments = command->arguments;
+    TRACE(TRACE_BUILTIN, 0, arguments[0]);
+    job->pids[stage] = getpid(); //it runs inside the shell
+
+    if(!on_thread){
+        struct BuiltinCall call = {
+            .arguments = arguments,
+            .in_fd = in_fd >= 0 ? in_fd : STDIN_FILENO,
+            .out_fd = out_fd >= 0 ? out_fd : STDOUT_FILENO,
+        };
+        struct rusage before;
+        getrusage(RUSAGE_THREAD, &before);
+        int exit_code = builtin->run(&call);
+        struct rusage *usage = &job->usages[stage];
+        getrusage(RUSAGE_THREAD, usage);
+        timersub(&usage->ru_utime, &before.ru_utime, &usage->ru_utime); //only what this builtin used
+        timersub(&usage->ru_stime, &before.ru_stime, &usage->ru_stime);
+        usage->ru_nvcsw -= before.ru_nvcsw;
+        usage->ru_nivcsw -= before.ru_nivcsw;
+        job_stage_done(table, job, stage, exit_code);
+        return;
+    }
+
+    struct BuiltinStage *thread_stage = calloc(1, sizeof(*thread_stage));
+    thread_stage->builtin = builtin;
+    thread_stage->arguments = copy_arguments(arguments);
+    thread_stage->in_fd = in_fd >= 0 ? fcntl(in_fd, F_DUPFD_CLOEXEC, 0) : -1; //the shell closes its own pipe ends right after this
+    thread_stage->out_fd = out_fd >= 0 ? fcntl(out_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    thread_stage->table = table;
+    thread_stage->job = job;
+    thread_stage->stage = stage;
+    thread_stage->interruptible = interrupt_fd >= 0 && !job->background && !job->batch;
+
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attributes, 256 * 1024); //builtins are small, no need for the default 8 MiB
+    if(command->placement != NULL && command->placement->has_cpus){
+        pthread_attr_setaffinity_np(&attributes, sizeof(cpu_set_t), &command->placement->cpus); //@mem= is only for children
+    }
+    if(pthread_create(&thread, &attributes, builtin_thread, thread_stage) != 0){
+        fprintf(stderr, "Error: cannot start builtin\n");
+        if(thread_stage->in_fd >= 0){
+            close(thread_stage->in_fd);
+        }
+        if(thread_stage->out_fd >= 0){
+            close(thread_stage->out_fd);
+        }
+        free(thread_stage->arguments);
+        free(thread_stage);
+        job->pids[stage] = -1;
+        job_stage_done(table, job, stage, 1);
+    }
+    else{
+        table->builtin_threads++;
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+bool shell_report(char **arguments){
+    /* The shell builtins that only show the shell's state: jobs, and hash and export without arguments */
+    return !strcmp(arguments[0], "jobs") || (arguments[1] == NULL && (!strcmp(arguments[0], "hash") || !strcmp(arguments[0], "export")));
+}
+
+void run_shell_stage(struct JobTable *table, struct Job *job, int stage, const struct Builtin *builtin,
+                     struct Command *command, int out_fd){
+    /* A shell builtin that isn't alone on its line. One that only shows the shell's state runs here, on
+       the main thread that owns that state, into a memfd that a cat stage then copies to out_fd (the
+       reader of the pipe may not even be started yet). The others would change the shell from inside
+       a pipeline or the background, so they are refused */
+    if(!shell_report(command->arguments)){
+        fprintf(stderr, "Error: %s cannot be used in a pipeline or in the background\n", command->arguments[0]);
+        job->pids[stage] = -1;
+        job_stage_done(table, job, stage, 1);
+        return;
+    }
+    int report = memfd_create("report", MFD_CLOEXEC);
+    struct BuiltinCall call = { .arguments = command->arguments, .in_fd = -1, .out_fd = report, .table = table };
+    int exit_code = report >= 0 ? builtin->run(&call) : 1;
+    if(exit_code != 0){
+        if(report >= 0){
+            close(report);
+        }
+        job->pids[stage] = -1;
+        job_stage_done(table, job, stage, exit_code);
+        return;
+    }
+    lseek(report, 0, SEEK_SET);
+    char *cat_arguments[] = { "cat", NULL };
+    struct Command cat = { .arguments = cat_arguments, .placement = command->placement };
+    run_builtin_stage(table, job, stage, builtin_lookup("cat"), &cat, report, out_fd, true);
+    close(report); //the stage has its own copy
+}
+
+void pipeline(struct CommandLine *line, char *cmd_copy, struct JobTable *table);
+
+void singular_command(struct CommandLine *line, char *cmd_copy, struct JobTable *table){
+    struct Command command = line->commands[0];
+
+    if(assignment_command(&command)){ //shell variables, exported only if they already were
+        for(int i = 0; command.arguments[i] != NULL; i++){
+            assign_variable(table, command.arguments[i], false);
+        }
+        int exit_code = 0;
+        print_completion(cmd_copy, &exit_code, 1);
+        last_status = exit_code;
+        return;
+    }
+
+    /* Builtins that change or show the shell's own state run right here, the rest go through pipeline
+       (which also runs the stateless builtins without a child) */
+    const struct Builtin *builtin = builtin_command(command.arguments);
+    if(builtin != NULL && builtin->shell){
+        struct BuiltinCall call = {
+            .arguments = command.arguments,
+            .in_fd = STDIN_FILENO,
+            .out_fd = STDOUT_FILENO,
+            .table = table,
+            .cmd_copy = cmd_copy,
+        };
+        interrupt_clear();
+        interruptible = true; //wait can be stopped with ^C
+        int exit_code = builtin->run(&call);
+        interruptible = false;
+        print_completion(cmd_copy, &exit_code, 1);
+        last_status = exit_code;
+        return;
+    }
+
+    /* Execute other commands that aren't built in, and check for errors */
+    pipeline(line, cmd_copy, table);
+}
+
+/* The memo cache: the memo prefix stores a line's output and exit codes under a hash of everything
+   that decides them (the argv of every stage, the cwd, the SSHELL_MEMO_ENV variables, and the identity
+   of the < input file or the text of a <<< here-string), and replays them while none of it changes. Each entry is one file named by
+   that hash: the output, then the key and the exit codes, then a fixed size footer. A hit bumps the
+   file's mtime, so evicting the oldest mtimes first keeps the directory an LRU under SSHELL_MEMO_SIZE.
+   Files a command opens by itself (sort data.txt) are not part of the key, only < is */
+
+#define MEMO_MAGIC 0x316f6d656d6873ULL //"shmemo1"
+
+struct MemoFooter {
+    unsigned long long magic;
+    unsigned long long output_length;
+    unsigned int key_length;
+    unsigned int num_stages;
+};
+
+struct Memo { //a memoized line that is running, to be stored once it's done
+    char *key;
+    size_t key_length;
+    char path[PATH_MAX]; //where the entry goes
+    char temporary[PATH_MAX]; //where the output is going meanwhile
+    int output_fd; //the temporary file, the last stage's stdout
+    int destination_fd; //where the output really goes: the > file, or -1 for the shell's stdout
 };
 
-void check_background_processes(struct Background* background_process){
-    int status; 
-    pid_t pid_array[4]; //up to 4 commands in a pipeline
+void memo_key_append(char **key, size_t *length, size_t *capacity, const char *data, size_t size){
+    if(*length + size > *capacity){
+        *capacity = (*length + size) * 2 + 256;
+        *key = realloc(*key, *capacity);
+    }
+    memcpy(*key + *length, data, size);
+    *length += size;
+}
 
-    /*Check to see if the background process is completed*/
+char *memo_key(struct CommandLine *line, size_t *key_length){
+    /* Everything that decides the output, as one byte string with NUL separators */
+    char *key = NULL;
+    size_t length = 0, capacity = 0;
 
-    for(int i = 0; i < background_process->background_commands; i++){
-        if(background_process->pids[i] == -1){ //this command already finished
-            continue; //look at next command
+    for(int i = 0; i < line->num_commands; i++){
+        for(int j = 0; line->commands[i].arguments[j] != NULL; j++){
+            char *argument = line->commands[i].arguments[j];
+            memo_key_append(&key, &length, &capacity, argument, strlen(argument) + 1);
         }
+        memo_key_append(&key, &length, &capacity, "|", 2);
+    }
 
-        pid_array[i] = waitpid(background_process->pids[i], &status, WNOHANG);
+    char *cwd = getcwd(NULL, 0);
+    if(cwd != NULL){
+        memo_key_append(&key, &length, &capacity, cwd, strlen(cwd) + 1);
+        free(cwd);
+    }
 
-        if(pid_array[i] > 0){ //process actually finished
-            background_process->completed_processes++;
-            background_process->exit_codes[i] = WEXITSTATUS(status);
-            background_process->pids[i] = -1; //mark as finished
-        }else { //not completed yet
-            return;
-        }
+    char *names = strdup(memo_environment);
+    for(char *name = strtok(names, ":,"); name != NULL; name = strtok(NULL, ":,")){
+        char *value = getenv(name);
+        memo_key_append(&key, &length, &capacity, name, strlen(name) + 1);
+        memo_key_append(&key, &length, &capacity, value ? value : "", value ? strlen(value) + 1 : 0); //unset and empty differ
     }
+    free(names);
 
-    if(background_process->completed_processes == background_process->background_commands){ //if all commands are ready
-        fprintf(stderr, "+ completed '%s' ", background_process->command_string);
-        for(int i = 0; i < background_process->background_commands; i++){
-            fprintf(stderr, "[%d]", background_process->exit_codes[i]);
-            background_process->pids[i] = -1; // reset PID
-        }
-        fprintf(stderr, "\n");
-        background_process->command_string[0] = '\0'; // clear the command string
-        background_process->currently_executing = false; //reset the variable to false
-        background_process->background_commands = 0;
-        background_process->completed_processes = 0;
+    struct stat input;
+    if(line->commands[0].input != NULL && line->commands[0].here_string){ //a new memfd every time, the text is what counts
+        memo_key_append(&key, &length, &capacity, "<<<", 4);
+        memo_key_append(&key, &length, &capacity, line->commands[0].input, strlen(line->commands[0].input) + 1);
+    }
+    else if(line->commands[0].input != NULL && fstat(line->commands[0].read_fd, &input) == 0){
+        long long identity[5] = { input.st_dev, input.st_ino, input.st_size, input.st_mtim.tv_sec, input.st_mtim.tv_nsec };
+        memo_key_append(&key, &length, &capacity, (char *)identity, sizeof(identity));
     }
-    return;
+
+    *key_length = length;
+    return key;
 }
 
-int count_arguments(char *cmd){
-    /* Count the number of arguments (to check if there's more than 16) */
-    int arguments = 0;
-    bool isWord = false;
-    for(int i = 0; cmd[i] != '\0'; i++){
-        if(!isspace(cmd[i])){
-            if(isWord == false){
-            arguments++;
-            isWord = true;
-            }
-        }
-        else{                                           
-            isWord = false;
-        }
+void memo_path(char *path, const char *key, size_t key_length){
+    /* The entry's file: its key's 64-bit FNV-1a in hex, inside the cache directory */
+    unsigned long hash = 14695981039346656037UL;
+    for(size_t i = 0; i < key_length; i++){
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211UL;
     }
-    if(arguments > 16){
-        fprintf(stderr, "Error: too many process arguments\n");
-        return 1;
+    snprintf(path, PATH_MAX, "%s/%016lx", memo_directory, hash);
+}
+
+bool memo_replay(struct JobTable *table, struct CommandLine *line, struct Job *job, const char *path, const char *key, size_t key_length){
+    /* On a hit writes the stored output where this line's output goes and completes the job with the
+       stored exit codes. false if there is no entry or it's for another key (a hash collision) */
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return false;
     }
-    return 0;
+
+    struct stat info;
+    struct MemoFooter footer;
+    bool hit = fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(footer)
+            && pread(fd, &footer, sizeof(footer), info.st_size - sizeof(footer)) == sizeof(footer)
+            && footer.magic == MEMO_MAGIC && footer.key_length == key_length && (int)footer.num_stages == job->num_stages
+            && footer.output_length + key_length + footer.num_stages * sizeof(int) + sizeof(footer) == (unsigned long long)info.st_size;
+    int *exit_codes = NULL;
+    if(hit){
+        char *stored_key = malloc(key_length);
+        exit_codes = malloc(footer.num_stages * sizeof(int));
+        hit = pread(fd, stored_key, key_length, footer.output_length) == (ssize_t)key_length
+           && !memcmp(stored_key, key, key_length)
+           && pread(fd, exit_codes, footer.num_stages * sizeof(int), footer.output_length + key_length)
+              == (ssize_t)(footer.num_stages * sizeof(int));
+        free(stored_key);
+    }
+    if(hit){
+        struct Command *last = &line->commands[line->num_commands - 1];
+        copy_range(fd, 0, footer.output_length, last->output != NULL ? last->write_fd : STDOUT_FILENO);
+        futimens(fd, NULL); //most recently used now
+        for(int i = 0; i < job->num_stages; i++){
+            job->pids[i] = -1;
+            job_stage_done(table, job, i, exit_codes[i]);
+        }
+    }
+    free(exit_codes);
+    close(fd);
+    return hit;
 }
 
-char* remove_whitespace(char *cmd_string){
-    char* whitespace_string = cmd_string;
-    char *no_whitespace_string = malloc(strlen(cmd_string) + 1);
-    char *output_ptr = no_whitespace_string;
+struct MemoEntry {
+    char name[32];
+    long long used; //mtime in ns, bumped on every hit
+    off_t size;
+};
+
+int memo_entry_compare(const void *a, const void *b){
+    const struct MemoEntry *x = a, *y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
 
-    while (*whitespace_string!= '\0') { //while the input string has characters
-        if (!isspace((unsigned char)*whitespace_string)) { //check if the character is not a whitespace
-            *output_ptr = *whitespace_string; //copy the non-whitespace character to the output string
-            output_ptr++;
+void memo_evict(void){
+    /* Deletes the least recently used entries until the directory fits in memo_size_max */
+    DIR *directory = opendir(memo_directory);
+    if(directory == NULL){
+        return;
+    }
+    struct MemoEntry *entries = NULL;
+    int count = 0, capacity = 0;
+    long long total = 0;
+    struct dirent *dirent;
+    while((dirent = readdir(directory)) != NULL){
+        struct stat info;
+        if(dirent->d_name[0] == '.' || strlen(dirent->d_name) >= sizeof(entries->name)
+           || fstatat(dirfd(directory), dirent->d_name, &info, 0) != 0){
+            continue; //temporaries of running lines start with a dot
+        }
+        if(count == capacity){
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(struct MemoEntry));
         }
-        whitespace_string++; //move on to the next character
+        strcpy(entries[count].name, dirent->d_name);
+        entries[count].used = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+        entries[count].size = info.st_blocks * 512; //what it takes on disk
+        total += entries[count].size;
+        count++;
     }
 
-    *output_ptr = '\0'; //null-terminate the output string
-    return no_whitespace_string;
-    
+    if(total > memo_size_max){
+        qsort(entries, count, sizeof(struct MemoEntry), memo_entry_compare);
+        for(int i = 0; i < count && total > memo_size_max; i++){
+            if(unlinkat(dirfd(directory), entries[i].name, 0) == 0){
+                total -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+    closedir(directory);
 }
 
-/*Finds errors left to right, and also looks for input and output redirection*/
-bool detect_errors(char *cmd, struct Command *commands){
+struct Memo *memo_start(struct JobTable *table, struct CommandLine *line, struct Job *job){
+    /* For a memo line: replays it and returns NULL on a hit, otherwise returns what's needed to store
+       it, with the last stage's stdout pointed at a temporary file. NULL (and the line just runs) if
+       the cache directory isn't usable */
+    size_t key_length;
+    char *key = memo_key(line, &key_length);
+    struct Memo *memo = malloc(sizeof(struct Memo));
+    memo->key = key;
+    memo->key_length = key_length;
+    memo_path(memo->path, key, key_length);
 
-    char* non_whitespace_cmd = remove_whitespace(cmd);
-    if(*non_whitespace_cmd == '\0'){
-        commands[0].need_background_command = false;
-        return false; //no input
+    if(memo_replay(table, line, job, memo->path, key, key_length)){
+        free(key);
+        free(memo);
+        return NULL;
     }
 
-    char *command_pointer = non_whitespace_cmd; //pointer to our string
-    bool command_start = true; //expecting the first characters besides white space to be a command
-    int cmd_length = strlen(non_whitespace_cmd); //find length of the string command
+    snprintf(memo->temporary, PATH_MAX, "%s/.tmp-XXXXXX", memo_directory);
+    memo->output_fd = make_directories(memo_directory) ? mkostemp(memo->temporary, O_CLOEXEC) : -1;
+    if(memo->output_fd < 0){
+        free(key);
+        free(memo);
+        return NULL;
+    }
+    struct Command *last = &line->commands[line->num_commands - 1];
+    memo->destination_fd = last->output != NULL ? fcntl(last->write_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    return memo;
+}
 
+void memo_finish(struct Job *job){
+    /* The memo line is done: hand its output to where it was going, and keep it if every stage succeeded
+       (a failure is more likely to be something that will go away than a result) */
+    struct Memo *memo = job->memo;
+    off_t output_length = lseek(memo->output_fd, 0, SEEK_END);
+    copy_range(memo->output_fd, 0, output_length, memo->destination_fd >= 0 ? memo->destination_fd : STDOUT_FILENO);
 
-    while(*command_pointer != '\0'){ //while the string still has characters
+    bool succeeded = true;
+    for(int i = 0; i < job->num_stages; i++){
+        succeeded = succeeded && job->exit_codes[i] == 0;
+    }
+    struct MemoFooter footer = { MEMO_MAGIC, output_length, memo->key_length, job->num_stages };
+    if(succeeded
+       && !write_all(memo->output_fd, memo->key, memo->key_length)
+       && !write_all(memo->output_fd, (char *)job->exit_codes, job->num_stages * sizeof(int))
+       && !write_all(memo->output_fd, (char *)&footer, sizeof(footer))
+       && rename(memo->temporary, memo->path) == 0){
+        memo_evict();
+    }
+    else{
+        unlink(memo->temporary);
+    }
 
-        if(command_start == true){ //expecting a letter, not symbols
-            if(*command_pointer == '<' || *command_pointer == '|' || *command_pointer == '>' || *command_pointer == '&'){
-                fprintf(stderr, "%s", MISSING_COMMAND);
-                return true;
-            }
-            command_start = false;
-        }
+    close(memo->output_fd);
+    if(memo->destination_fd >= 0){
+        close(memo->destination_fd);
+    }
+    free(memo->key);
+    free(memo);
+    job->memo = NULL;
+}
 
-        if(*command_pointer == '>'){ //expecting output
-            command_pointer++;
-                
-            if(*command_pointer == '<' || *command_pointer == '|' || *command_pointer == '>' || *command_pointer == '&' || *command_pointer == '\0'){
-                fprintf(stderr, "%s", NO_OUTPUT);
-                return true;
-            }
-            
-                //how can i find a way to extract just the output file name now, or should i wait to do this via tokenization?
-        }
+char *read_command_line(struct LineReader *reader, struct JobTable *table){
+    /* Like getline on stdin (any length, keeps the newline), but while it waits for input the event loop
+       also collects jobs, so their completion is printed right away instead of at the next command.
+       The line stays valid until the next call. Returns NULL on EOF */
+    while(1){
+        size_t available = reader->end - reader->start;
+        char *nl = available > 0 ? memchr(reader->buffer + reader->start, '\n', available) : NULL; //no buffer before the first read
 
-        if(*command_pointer == '<'){ //expecting input
-            command_pointer++;
-                
-            if(*command_pointer == '<' || *command_pointer == '|' || *command_pointer == '>' || *command_pointer == '&' || *command_pointer == '\0'){
-               fprintf(stderr, "%s", NO_INPUT);
-                return true;
+        if(nl != NULL || (reader->eof && available > 0)){
+            size_t length = nl ? (size_t)(nl - (reader->buffer + reader->start)) + 1 : available;
+            if(length + 1 > reader->line_capacity){
+                reader->line_capacity = length + 1;
+                reader->line = realloc(reader->line, reader->line_capacity);
             }
-                //how can i find a way to extract just the output file name now, or should i wait to do this via tokenization?
+            memcpy(reader->line, reader->buffer + reader->start, length);
+            reader->line[length] = '\0';
+            reader->start += length;
+            return reader->line;
         }
-
-        if(*command_pointer == '|'){
-            command_pointer++;
-            if(*command_pointer == '<' || *command_pointer == '|' || *command_pointer == '>' || *command_pointer == '&' || *command_pointer == '\0'){
-                fprintf(stderr, "%s", MISSING_COMMAND);
-                return true;
+        if(reader->eof){
+            if(table->running > 0 && reader->fd == STDIN_FILENO){ //exit is going to be refused, so don't spin on it: let a job finish first
+                handle_events(table, -1);
             }
+            return NULL;
         }
 
-        if(*command_pointer == '&'){
-            if((command_pointer - non_whitespace_cmd) == (cmd_length - 1)){ //check if we are at the end of the string
-                commands[0].need_background_command = true;
-                free(non_whitespace_cmd);
-                return false;
-            }
-            else{ //ambersand was not at the end of the string
-                fprintf(stderr, "Error: mislocated background sign\n");
-                return true;
-            }
+        if(!table->stdin_pollable){ //a regular file never blocks, just catch up on the jobs and read
+            check_background_processes(table);
+            reader_fill(reader);
+            continue;
         }
-        else{
-            commands[0].need_background_command = false;
+        watch_stdin(table, true); //room for more now, if the typeahead limit had switched it off
+        table->at_prompt = true;
+        int collected = handle_events(table, -1);
+        table->at_prompt = false;
+        if(collected > 0 && report_finished_jobs(table) > 0 && isatty(reader->fd)){
+            printf(PROMPT); //the completion message went out after the prompt, so show it again
+            fflush(stdout);
         }
-
-        command_pointer++;
     }
-
-    free(non_whitespace_cmd);
-    return false;
 }
 
-int parse_input_output_files(struct Command *commands, int num_commands){
+void start_substitution(struct JobTable *table, struct Job *job, int stage, struct Substitution *substitution, bool background){
+    /* Starts the command of a <(...) or >(...) as an unreported stage of the job, on a pipe whose
+       other end the line's commands reach through the /dev/fd/N word */
+    int pipe_fds[2];
+    if(pipe2(pipe_fds, O_CLOEXEC) != 0){
+        job_stage_done(table, job, stage, 1);
+        return;
+    }
+    int mine = substitution->output ? pipe_fds[1] : pipe_fds[0];
+    int theirs = substitution->output ? pipe_fds[0] : pipe_fds[1];
+    int in_fd = substitution->output ? theirs : -1; //<(...) has the shell's stdin, like the line's first command
+    int out_fd = substitution->output ? -1 : theirs;
+    if(!substitution->output && background){
+        if(table->null_fd < 0){
+            table->null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        in_fd = table->null_fd;
+    }
 
-    for(int i = 0; i < num_commands; i++){
-        for(int j = 0; commands[i].arguments[j] != NULL; j++){
+    struct Command *command = &substitution->command;
+    clock_gettime(CLOCK_MONOTONIC, &job->started[stage]);
+    const struct Builtin *builtin = builtin_command(command->arguments);
+    if(builtin != NULL && builtin->shell){
+        run_shell_stage(table, job, stage, builtin, command, out_fd);
+    }
+    else if(builtin != NULL){
+        run_builtin_stage(table, job, stage, builtin, command, in_fd, out_fd, true);
+    }
+    else{
+        job->stats[stage] = stats_for(command->arguments[0]);
+        command->pid = launch_command(command->arguments, in_fd, out_fd, NULL, job->stats[stage]);
+        job_add_pid(table, job, stage, command->pid);
+    }
+    close(theirs);
+    snprintf(substitution->word, SUBSTITUTION_WORD, "/dev/fd/%d", mine);
+    job->substitution_fds[stage - job->num_stages] = mine;
+}
 
-            char *arg = commands[i].arguments[j];
-            char *output_symbol = strchr(arg, '>');
-            char *input_symbol = strchr(arg, '<');
+bool pipeline_pipe(struct Job *job, int i, int pipe_fds[2]){
+    /* The pipe between stage i and i + 1, with a meter relay in the middle on metered lines. false, with
+       nothing left open, when out of fds or threads */
+    if(pipe2(pipe_fds, O_CLOEXEC) != 0){ //only the stages we dup2 them into should keep them
+        return false;
+    }
+    if(pipe_size > 0){
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size); //bigger pipes mean fewer context switches on bulk data
+    }                                                //(if it's over /proc/sys/fs/pipe-max-size we just keep the default)
+    if(job->meters == NULL){
+        return true;
+    }
 
-            /*if we have a output redirection in the argument*/
-            if(output_symbol != NULL){ 
+    int relay_fds[2]; //stage i writes into the pipe, a relay moves it into a second one for stage i + 1
+    if(pipe2(relay_fds, O_CLOEXEC) != 0){
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    }
+    if(pipe_size > 0){
+        fcntl(relay_fds[1], F_SETPIPE_SZ, pipe_size);
+    }
+    struct Meter *meter = &job->meters[i];
+    meter->in_fd = pipe_fds[0];
+    meter->out_fd = relay_fds[1]; //both belong to the relay now, it closes them
+    if(pthread_create(&meter->thread, NULL, meter_relay, meter) != 0){
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        close(relay_fds[0]);
+        close(relay_fds[1]);
+        return false;
+    }
+    meter->running = true;
+    pipe_fds[0] = relay_fds[0];
+    return true;
+}
 
-                //if it's not the last command
-                if(i != num_commands - 1){ 
-                    fprintf(stderr, "%s", MISLOCATED_OUTPUT);
-                    return -1;
-                }
+void pipeline(struct CommandLine *line, char *cmd_copy, struct JobTable *table){
+    struct Command *commands = line->commands;
+    int num_commands = line->num_commands;
+    bool background = line->background;
+    if(!background && !line->batch){
+        interrupt_clear();
+    }
+    struct Job *job = job_create(table, cmd_copy, num_commands + line->num_substitutions, background);
+    job->num_stages = num_commands;
+    job->timed = line->timed;
+    place_automatic(line);
+    if(line->metered && num_commands > 1){
+        job->meters = calloc(num_commands - 1, sizeof(struct Meter));
+    }
+    if(line->batch){
+        job_add_batch(table, job); //before any pid, a stage that fails to launch completes the job right away
+    }
+    if(line->memoized && line->num_substitutions == 0){ //what a /dev/fd/N holds isn't part of the key
+        job->memo = memo_start(table, line, job);
+        if(job->memo == NULL && job->completed_processes == num_commands){ //replayed from the cache, nothing to start
+            if(commands[0].input != NULL){
+                close(commands[0].read_fd);
+            }
+            if(commands[num_commands - 1].output != NULL){
+                close(commands[num_commands - 1].write_fd);
+            }
+            if(background || line->batch){
+                return; //already complete, reported with the others
+            }
+            report_finished_jobs(table);
+            report_job(job);
+            job_free(table, job);
+            return;
+        }
+    }
 
-                /*Attempt to find where the > is*/
-                char *filename = NULL;
+    /* Process substitutions first, so the line's commands can open their /dev/fd/N. Those fds are only
+       inherited by the line's commands: close-on-exec is off just while they start */
+    job->num_substitutions = line->num_substitutions;
+    if(line->num_substitutions > 0){
+        job->substitution_fds = malloc(line->num_substitutions * sizeof(int));
+        job->substitution_users = malloc(line->num_substitutions * sizeof(int));
+    }
+    for(int i = 0; i < line->num_substitutions; i++){
+        job->substitution_fds[i] = -1;
+        job->substitution_users[i] = -1;
+        start_substitution(table, job, num_commands + i, &line->substitutions[i], background || line->batch);
+        if(job->substitution_fds[i] >= 0){
+            fcntl(job->substitution_fds[i], F_SETFD, 0);
+        }
+    }
 
-                //case 1; argument is just ">" by itself
-                if(strcmp(arg, ">") == 0){ 
-                    strcpy(commands[i].output, commands[i].arguments[j + 1]); //set the output equal to the file name (which is after the ">" symbol)
-                    free(commands[i].arguments[j]);                           //free the empty argument where ">" used to be
-                    free(commands[i].arguments[j + 1]);                       //free the argument with the file name
-                    commands[i].arguments[j]= NULL;              
-                    commands[i].arguments[j + 1] = NULL;
-                }
-                
-                
-                //case 2: " >file.txt"
-                else if(arg[0] == '>'){
-                    filename = arg + 1;
-                    strcpy(commands[i].output, filename);
-                    free(commands[i].arguments[j]);
-                    commands[i].arguments[j] = NULL;
-                }
-                    
-                //case 3: "cmd> file.txt" || "cmd>file.txt"
-                else if(output_symbol != arg){
-                    filename = output_symbol + 1;
-
-                     //case: "cmd> file.txt"
-                    if(*filename == '\0'){
-                        strcpy(commands[i].output, commands[i].arguments[j + 1]);
-                        free(commands[i].arguments[j+1]);
-                        commands[i].arguments[j+1] = NULL;
-                    }
+    int previous_read = -1; //read end of the pipe coming out of the previous stage
+                            //only one pipe is open in the shell at a time, so any number of stages fits in the fd limit
 
-                    //case: "cmd>file.txt"
-                    else{
-                        strcpy(commands[i].output, filename);
-                    }
+    for(int i = 0; i < num_commands; i++){ //create a child for every command we need
+        int in_fd = -1;
+        int out_fd = -1;
+        int pipe_fds[2] = { -1, -1 };
 
-                    //remove everything after >
-                    *output_symbol = '\0';
-                    //free(commands[i].arguments[j]);
-                    //commands[i].arguments[j] = strdup(arg);
+        if(i < num_commands - 1){ //if not the last pipe, write to the written portion of a new pipe
+            if(!pipeline_pipe(job, i, pipe_fds)){
+                fprintf(stderr, "Error: cannot create pipe\n");
+                for(int j = i; j < num_commands; j++){ //the stages already started get EOF or EPIPE and end on their own
+                    job->pids[j] = -1;
+                    job_stage_done(table, job, j, 1);
                 }
-
-                commands[i].write_fd = open(commands[i].output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if(commands[i].write_fd < 0){
-                    fprintf(stderr, "%s", OUTPUT_UNOPENED);
-                    return -1;
+                if(i > 0){
+                    close(previous_read);
                 }
-                break; // go to next i
+                break;
             }
-            else{
-                commands[i].output[0] = '\0';
+            out_fd = pipe_fds[1];
+        }
+        if(i == 0 && commands[0].input != NULL){ //if the first pipe has an input redirection
+            in_fd = commands[0].read_fd;
+        }
+        else if(i == 0 && (background || line->batch)){ //like any shell without job control, the shell's stdin
+            if(table->null_fd < 0){                        //stays with the shell (it's the script, under -j)
+                table->null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
             }
+            in_fd = table->null_fd;
+        }
+        if(i > 0){ //if not the first pipe, read from the previous pipe
+            in_fd = previous_read;
+        }
+        if(i == num_commands - 1 && commands[num_commands - 1].output != NULL){ //if the last pipe has output redirection
+            out_fd = commands[num_commands - 1].write_fd;
+        }
+        if(i == num_commands - 1 && job->memo != NULL){ //into the cache first, it goes on to out_fd when the line is done
+            out_fd = job->memo->output_fd;
+        }
 
-            /*if we have an input redirection in the argument*/
-            if(input_symbol != NULL){ 
-
-                //if it's not the first command
-                if(i != 0){ 
-                    fprintf(stderr, "%s", MISLOCATED_INPUT);
-                    return -1;
+        clock_gettime(CLOCK_MONOTONIC, &job->started[i]);
+        const struct Builtin *builtin = builtin_command(commands[i].arguments);
+        if(builtin != NULL && builtin->shell){ //jobs | grep ...
+            run_shell_stage(table, job, i, builtin, &commands[i], out_fd);
+        }
+        else if(builtin != NULL){ //echo, test, ... don't need a process of their own
+            bool alone = num_commands == 1 && !background && !line->batch && interrupt_fd < 0; //interactive, it needs a thread so ^C can reach it
+            for(int j = 0; j < line->num_substitutions && !alone; j++){
+                for(char **argument = commands[i].arguments; *argument != NULL; argument++){
+                    if(*argument == line->substitutions[j].word){
+                        job->substitution_users[j] = i; //the thread opens it whenever it gets there
+                    }
                 }
+            }
+            run_builtin_stage(table, job, i, builtin, &commands[i], in_fd, out_fd, !alone);
+        }
+        else{
+            job->stats[i] = stats_for(commands[i].arguments[0]);
+            commands[i].pid = launch_command(commands[i].arguments, in_fd, out_fd, commands[i].placement, job->stats[i]);
+            job_add_pid(table, job, i, commands[i].pid); //keep record of the pid so we could return to it and see if it's finished
+        }
 
-                /*Attempt to find where the < is*/
-                char *filename = NULL;
+        if(i < num_commands - 1){ //close the write end of the pipe for the current commands
+            close(pipe_fds[1]);   //(since it won't need to write anymore)
+        }
+        if(i > 0){ //close the read end of the previous pipe (since we read from it already)
+            close(previous_read);
+        }
+        previous_read = pipe_fds[0];
+    }
 
-                //case 1; argument is just "<" by itself
-                if(strcmp(arg, "<") == 0){ 
-                    strcpy(commands[i].input, commands[i].arguments[j + 1]); //set the input equal to the file name (which is after the "<" symbol)
-                    free(commands[i].arguments[j]);                          //free the empty argument where "<" used to be
-                    free(commands[i].arguments[j + 1]);                      //free the argument with the file name
-                    commands[i].arguments[j] = NULL;
-                    commands[i].arguments[j + 1] = NULL;
-                }
+    //the children have their own copies of the redirection files and substitution pipes now
+    for(int i = 0; i < job->num_substitutions; i++){
+        if(job->substitution_fds[i] < 0){
+            continue;
+        }
+        if(job->substitution_users[i] < 0){
+            close(job->substitution_fds[i]);
+            job->substitution_fds[i] = -1;
+        }
+        else{
+            fcntl(job->substitution_fds[i], F_SETFD, FD_CLOEXEC); //a builtin still needs it, but no other child should get it
+        }
+    }
+    if(commands[0].input != NULL){
+        close(commands[0].read_fd);
+    }
+    if(commands[num_commands - 1].output != NULL){
+        close(commands[num_commands - 1].write_fd);
+    }
 
-                //case 2: " <file.txt"
-                else if(arg[0] == '<'){
-                    filename = arg + 1;
-                    strcpy(commands[i].input, filename);
-                    free(commands[i].arguments[j]); //free the argument with "<file.txt"
-                    commands[i].arguments[j] = NULL;
-                }
+    if(background || line->batch){
+        return; //reported later, once all of its stages have been reaped
+    }
 
-                //case 3: "cmd< file.txt" || "cmd<input.txt"
-                else if(input_symbol != arg){
-                    filename = input_symbol + 1;
+    //wait for processes/children to finish
+    wait_for_job(table, job, commands[0].input == NULL && table->reader->fd == STDIN_FILENO);
 
-                    //case: "cmd< file.txt"
-                    if(*filename == '\0'){
-                        strcpy(commands[i].input, commands[i].arguments[j + 1]); //set the input equal to the file name (which is in the next argument)
-                        free(commands[i].arguments[j + 1]);                       //free the argument with the file name
-                        commands[i].arguments[j + 1] = NULL;
-                    }
+    report_finished_jobs(table); //background jobs that finished meanwhile go first
 
-                    //case: "cmd<input.txt"
-                    else{
-                        strcpy(commands[i].input, filename); //set the input equal to the file name (which follows the "<" in the same argument)
-                    }
+    /*Completion message*/
+    report_job(job);
+    job_free(table, job);
+}
 
-                    //remove everything after <
-                    *input_symbol = '\0';
-                    //free(commands[i].arguments[j]);         //free the old full argument
-                    //commands[i].arguments[j] = strdup(arg); //replace with cleaned-up version (command only)
-                }
 
-                commands[i].read_fd = open(commands[i].input, O_RDONLY);
-                if(commands[i].read_fd < 0){
-                    fprintf(stderr, "%s", INPUT_UNOPENED);
-                    return -1;
-                }
-                break; // go to next i
-            }
-            else{
-                commands[i].input[0] = '\0';
-            }
-        }
+long long parse_size(const char *setting){
+    /* Bytes, or with a K/M/G suffix */
+    char *suffix;
+    long long size = strtoll(setting, &suffix, 10);
+    if(*suffix == 'K' || *suffix == 'k'){
+        size *= 1024;
     }
-    return 0;
+    else if(*suffix == 'M' || *suffix == 'm'){
+        size *= 1024 * 1024;
+    }
+    else if(*suffix == 'G' || *suffix == 'g'){
+        size *= 1024 * 1024 * 1024;
+    }
+    return size;
 }
 
-int extract_tokens(char *cmd, struct Command *commands, struct Background *background_process){
-    /*GOAL: extracting all the command(s) and their respective arguments*/
-    int num_commands = 0;
-
-    if(detect_errors(cmd, commands) == true){
-        return -1; //exit, in order to reprompt the shell
+void argument_limit(void){
+    /* The kernel's limit covers argv and the environment together, keep some slack like xargs does */
+    argument_bytes_max = sysconf(_SC_ARG_MAX) - variables.environment_bytes - 2048;
+    char *arg_max_setting = getenv("SSHELL_ARG_MAX"); //bytes, to be stricter than the kernel
+    if(arg_max_setting != NULL && atol(arg_max_setting) >= _POSIX_ARG_MAX && atol(arg_max_setting) < argument_bytes_max){
+        argument_bytes_max = atol(arg_max_setting); //never under POSIX's 4096, or not even exit would parse
     }
+}
 
-    char *token_ambersand = strtok(cmd, "&"); //removes the ambersands
+void load_settings(void){
+    /* Reads the SSHELL_* environment variables that tune the shell */
+    /* Runs again whenever export or unset changes one, so a setting that isn't there goes back to its default */
+    char *launcher = getenv("SSHELL_LAUNCHER");
+    use_fork_launcher = launcher != NULL && !strcmp(launcher, "fork");
 
-    char *token_commands = strtok(token_ambersand, "|"); //seperate the commands, if there is piping
+    char *size_setting = getenv("SSHELL_PIPE_SIZE"); //bytes, or with a K/M suffix
+    long long size = size_setting != NULL ? parse_size(size_setting) : 0;
+    pipe_size = size > 0 && size <= INT_MAX ? (int)size : 0;
 
-    /*Extract up to four commands (if there is piping)*/
-    while(token_commands != NULL && num_commands < 4){
-        strcpy(commands[num_commands].sub_command, token_commands); //copies the sub command so we can tokenize the arguments for each section later
-        if(count_arguments(commands[num_commands].sub_command) == 1){
-            return -2; //error, the command has more than 16 arguments
-        }
-        token_commands = strtok(NULL, "|"); //move to the next command
-        num_commands++;
+    argument_limit();
+
+    char *memo_setting = getenv("SSHELL_MEMO_DIR");
+    char *cache_home = getenv("XDG_CACHE_HOME");
+    if(memo_setting != NULL && *memo_setting != '\0'){
+        snprintf(memo_directory, sizeof(memo_directory), "%s", memo_setting);
+    }
+    else if(cache_home != NULL && *cache_home != '\0'){
+        snprintf(memo_directory, sizeof(memo_directory), "%s/sshell/memo", cache_home);
+    }
+    else{
+        snprintf(memo_directory, sizeof(memo_directory), "%s/.cache/sshell/memo", getenv("HOME") ? getenv("HOME") : "/tmp");
     }
-        
-    /*Collect all the arguments for every command*/
-    char delimiter[] = " \t\n\v\f\r"; //ignore all forms of white space
-    char *token_arguments;
+    char *memo_size_setting = getenv("SSHELL_MEMO_SIZE"); //bytes, or with a K/M/G suffix
+    memo_size_max = memo_size_setting != NULL ? parse_size(memo_size_setting) : 64 * 1024 * 1024;
+    char *memo_environment_setting = getenv("SSHELL_MEMO_ENV");
+    memo_environment = memo_environment_setting != NULL ? memo_environment_setting : "PATH:LANG:LC_ALL";
 
-    for(int i = 0; i < num_commands; i++){
-        token_arguments = strtok(commands[i].sub_command, delimiter); //tokenize the arguments
-        int num_arguments = 0;
+    char *history_setting = getenv("SSHELL_HISTORY");
+    char *state_home = getenv("XDG_STATE_HOME");
+    if(history_setting != NULL){
+        snprintf(history_path, sizeof(history_path), "%s", history_setting); //empty turns history off
+    }
+    else if(state_home != NULL && *state_home != '\0'){
+        snprintf(history_path, sizeof(history_path), "%s/sshell/history", state_home);
+    }
+    else{
+        snprintf(history_path, sizeof(history_path), "%s/.local/state/sshell/history", getenv("HOME") ? getenv("HOME") : "/tmp");
+    }
+    if(getenv("SSHELL_HISTORY_SIZE") != NULL){ //bytes, or with a K/M/G suffix
+        history_size = parse_size(getenv("SSHELL_HISTORY_SIZE"));
+    }
 
-        while(token_arguments != NULL){ //while there is still arguments
-            commands[i].arguments[num_arguments] = malloc(strlen(token_arguments) + 1);
-            strcpy(commands[i].arguments[num_arguments], token_arguments);
-            num_arguments++;
-            token_arguments = strtok(NULL, delimiter);  //move on to the next argument
-        }
-        commands[i].arguments[num_arguments] = NULL;  //null-terminate
+    char *trace_path = getenv("SSHELL_TRACE"); //file the execution trace is appended to
+    if(trace_path != NULL && *trace_path != '\0' && !trace.enabled){
+        trace_start(trace_path, getenv("SSHELL_TRACE_FORMAT"));
     }
+}
 
-    /*assigns the input and output fils to the command if needed*/
-    if(parse_input_output_files(commands, num_commands) == -1){
-        return -1; //if error
-    };
+void usage(char *program){
+    fprintf(stderr, "usage: %s [-j N] [-u] [-q] [-c command | -s script | script]\n"
+                    "       %s --serve socket [-j N] [-u]\n"
+                    "       %s --connect socket [-q] [-c command | -s script | script]\n", program, program, program);
+    exit(EXIT_FAILURE);
+}
 
-    if(commands[0].need_background_command == true){
-        background_process->background_commands = num_commands;
-        background_process->currently_executing = true;
+int open_script(char *path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        fprintf(stderr, "Error: cannot open script file\n");
+        exit(127); //what sh gives for a script that isn't there
     }
-
-    return num_commands;
+    return fd;
 }
 
-void singular_command(struct Command command, char *cmd_copy, struct Background *background_process){
-    /* Builtin exit command */
-    if (!strcmp(command.arguments[0], "exit")) { //strcmp compares the user input cmd with "exit". If they match it will exit
-        if(background_process->currently_executing == true){ //check if a background command is currently executing before we can exit
-            fprintf(stderr, "Error: active job still running\n");
-            fprintf(stderr, "+ completed '%s' [%d]\n", cmd_copy, 1);
-            return;
-        }   
-        fprintf(stderr, "Bye...\n");
-        fprintf(stderr, "+ completed '%s' [%d]\n", cmd_copy, 0);
-        exit(0);
+/* Server: sshell --serve PATH keeps a warm shell on a Unix socket, sshell --connect PATH runs lines in it.
+   The client sends its stdin, stdout, stderr and working directory as fds (SCM_RIGHTS), then the
+   command lines, and gets back the completion lines followed by "+ exit N". Each client gets a session
+   of its own, forked before it even connects: SERVE_SPARES sessions wait in accept() and the server
+   only forks a replacement once one is taken, so a connection costs no exec, no dynamic loading, no
+   settings, and no fork on its path either */
+#define SERVE_SPARES 2
+#define SERVE_FDS 4 //stdin, stdout, stderr, cwd
+#define SERVE_SH_STATUSES 1 //in the flags byte: the client runs -c, so the session gives sh's statuses
+
+int serve_session(int connection){
+    /* In a session that was just handed a client: take over its stdio and directory. Returns the
+       socket, where the command lines come from and the completion lines go */
+    char flags;
+    char control[CMSG_SPACE(SERVE_FDS * sizeof(int))];
+    struct iovec data = { .iov_base = &flags, .iov_len = 1 };
+    struct msghdr message = { .msg_iov = &data, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    if(recvmsg(connection, &message, MSG_CMSG_CLOEXEC) != 1){
+        exit(EXIT_FAILURE);
     }
-    if(!strcmp(command.arguments[0], "cd")){
-        if(chdir(command.arguments[1]) != 0){ //used chdir to change parent directory without forking. Command.argument[1] because 1 argument will be given only
-            fprintf(stderr,"Error: cannot cd into directory\n");
-            fprintf(stderr, "+ completed '%s' [%d]\n", cmd_copy, 1);
-            return;
-        } 
-        fprintf(stderr, "+ completed '%s' [%d]\n", cmd_copy, 0);
-        return;
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if(header == NULL || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(SERVE_FDS * sizeof(int))){
+        exit(EXIT_FAILURE);
     }
-    if(!strcmp(command.arguments[0], "pwd")){
-        char path[CMDLINE_MAX]; //cwd needs buffer
-        getcwd(path, CMDLINE_MAX);//gives pwd, same as cwd
-        fprintf(stdout, "%s\n", path);
-        fprintf(stderr, "+ completed '%s' [%d]\n", cmd_copy, 0);
-        return;
+    int fds[SERVE_FDS];
+    memcpy(fds, CMSG_DATA(header), sizeof(fds));
+    for(int i = 0; i < 3; i++){
+        dup2(fds[i], i); //dup2 drops the close-on-exec flag, so commands get them like any stdio
+        close(fds[i]);
     }
+    if(fchdir(fds[3]) != 0){
+        fprintf(stderr, "Error: cannot change directory\n");
+    }
+    close(fds[3]);
+    sh_statuses = flags & SERVE_SH_STATUSES;
+    signal(SIGCHLD, SIG_DFL); //the server ignores it to reap sessions, a session has to wait for its jobs
+    completions = fdopen(connection, "w");
+    return connection;
+}
 
-    /* Execute other commands that aren't built in, and check for errors */
-    pid_t pid = fork();
-    if(pid == 0){ //this is the child
-
-        if(strcmp(command.input, "\0")){ //if input redirection has file
-            dup2(command.read_fd, STDIN_FILENO);
-            close(command.read_fd);
-        }
-        if(strcmp(command.output, "\0")){ //if output redirection has file
-            dup2(command.write_fd, STDOUT_FILENO);
-            close(command.write_fd);
-        }
+int serve(char *path){
+    /* Never returns in the server, returns the client's socket in a session */
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "Error: socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path); //a socket left behind by an earlier server
+    mode_t mask = umask(077); //the socket runs anything for anyone who can connect, so only this user can
+    if(listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0){
+        fprintf(stderr, "Error: cannot listen on socket\n");
+        exit(EXIT_FAILURE);
+    }
+    umask(mask);
 
-        if(execvp(command.arguments[0], command.arguments) == -1){
-            fprintf(stderr, "Error: command not found\n");
-            exit(1);
-        }
+    int taken[2]; //a session writes a byte here when it gets a client, so the server forks its replacement
+    if(pipe2(taken, O_CLOEXEC) != 0){
+        fprintf(stderr, "Error: cannot create pipe\n");
+        exit(EXIT_FAILURE);
     }
-    else if(pid > 0){ //this is the parent
-        if(command.need_background_command == true){
-            if(background_process->pids[0] == -1){ //if pid hasnt been set yet
-                background_process->pids[0] = pid; //keep record of this pid so we could return to it and see if it's finished
-                strncpy(background_process->command_string, cmd_copy, CMDLINE_MAX - 1);
-                background_process->command_string[CMDLINE_MAX - 1] = '\0'; //null-terminate the end
-                command.need_background_command = false; //don't need to enter this if statement anymore
-                return;
+    signal(SIGCHLD, SIG_IGN); //sessions are reaped by the kernel
+    pid_t server = getpid();
+    int spares = 0;
+    while(1){
+        while(spares < SERVE_SPARES){
+            pid_t pid = fork();
+            if(pid == 0){
+                close(taken[0]);
+                prctl(PR_SET_PDEATHSIG, SIGTERM); //nobody to connect to once the server is gone
+                if(getppid() != server){ //it went before that was set
+                    exit(EXIT_FAILURE);
+                }
+                int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+                prctl(PR_SET_PDEATHSIG, 0); //a session with a client finishes its lines whatever the server does
+                if(write_all(taken[1], "", 1)){ //only once the server is gone (EPIPE), nobody is left to start a spare
+                    fprintf(stderr, "Error: server is gone, no session will replace this one\n");
+                }
+                close(taken[1]);
+                close(listener);
+                if(connection < 0){
+                    exit(EXIT_FAILURE);
+                }
+                return serve_session(connection);
             }
-        }
-        else{
-            int status;
-            waitpid(pid, &status, 0);
-
-            if(background_process->currently_executing == true){
-                check_background_processes(background_process);
+            if(pid < 0){
+                sleep(1); //out of processes, try again once some sessions are done
+                break;
             }
-
-            fprintf(stderr, "+ completed '%s' [%d]\n", cmd_copy, WEXITSTATUS(status));
-            return;
+            spares++;
+        }
+        char byte;
+        ssize_t n = read(taken[0], &byte, 1);
+        if(n == 1){
+            spares--;
+        }
+        else if(n == 0 || errno != EINTR){ //the pool can't be kept full any more
+            fprintf(stderr, "Error: cannot hear from sessions\n");
+            exit(EXIT_FAILURE);
         }
     }
 }
 
-void pipeline(struct Command *commands, int num_commands, char *cmd_copy, struct Background *background_process){
-
-    int exit_codes[num_commands]; //array to store exit codes
-    int pipes[num_commands - 1][2]; //if we have N commands, we only need N - 1 pipes
-                                    // e.g "echo Hello world | grep Hello" there's 2 commands, only need 1 pipe
-                                    //the 2 means that every pipe will need 2 numbers (to create the read and the write sections)
+struct ClientSender {
+    struct LineReader *reader; //where the lines are: the -c buffer, a script, or stdin
+    int connection;
+};
 
-    for(int i = 0; i < num_commands - 1; i++){
-        pipe(pipes[i]); //create the R and W for every pipe we need
+void *client_send(void *argument){
+    /* Writes the command lines into the socket while main reads the results, so neither side can fill
+       its buffer and wait on the other */
+    struct LineReader *reader = ((struct ClientSender *)argument)->reader;
+    int connection = ((struct ClientSender *)argument)->connection;
+    if(reader->fd < 0){ //-c, the lines are in the buffer
+        write_all(connection, reader->buffer, reader->end);
     }
+    else{
+        copy_fd(reader->fd, connection);
+    }
+    shutdown(connection, SHUT_WR); //end of the script for the session
+    return NULL;
+}
 
-    for(int i = 0; i < num_commands; i++){ //create a child for every command we need
-
-        pid_t pid = fork();
-        if(pid == 0){
-            //if the first pipe has an input redirection
-            if(strcmp(commands[0].input, "\0") && (i == 0)){
-                dup2(commands[0].read_fd, STDIN_FILENO);
-                close(commands[0].read_fd);
-            }
-
-            //if not the first pipe, redirect input to be read from the previous pipe
-            if( i > 0 ){
-                dup2(pipes[i - 1][0], STDIN_FILENO);
-            }
-            
-            //if the last pipe has output redirection
-            if(strcmp(commands[num_commands - 1].output, "\0") && (i == num_commands - 1)){
-                dup2(commands[num_commands - 1].write_fd, STDOUT_FILENO);
-                close(commands[num_commands - 1].write_fd);
-            }
+int client(char *path, struct LineReader *reader){
+    /* sshell --connect: runs the lines in a server session, prints its completion lines (unless -q)
+       and returns the status it ended with */
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(connection < 0 || connect(connection, (struct sockaddr *)&address, sizeof(address)) != 0){
+        fprintf(stderr, "Error: cannot connect to server\n");
+        return EXIT_FAILURE;
+    }
 
-            //if not the last pipe, redirect output to go to the written portion of your pipe
-            if( i < num_commands - 1 ){
-                dup2(pipes[i][1], STDOUT_FILENO);
-            }
+    int fds[SERVE_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, open(".", O_PATH | O_DIRECTORY | O_CLOEXEC) };
+    if(reader->fd == STDIN_FILENO){ //the lines come from stdin, so the commands can't have it
+        fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    char flags = reader->fd < 0 ? SERVE_SH_STATUSES : 0;
+    char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+    struct iovec data = { .iov_base = &flags, .iov_len = 1 };
+    struct msghdr message = { .msg_iov = &data, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    if(fds[3] < 0 || fds[0] < 0 || sendmsg(connection, &message, 0) != 1){
+        fprintf(stderr, "Error: cannot connect to server\n");
+        return EXIT_FAILURE;
+    }
 
-            //close all pipes in the child
-            for (int j = 0; j < num_commands - 1; j++){
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
+    pthread_t sender;
+    struct ClientSender sending = { reader, connection };
+    pthread_create(&sender, NULL, client_send, &sending);
 
-            //execute the command for this section of the pipe
-            if(execvp(commands[i].arguments[0], commands[i].arguments) == -1){
-                fprintf(stderr, "Error: command not found\n");
-                exit(1);
-            }
+    FILE *results = fdopen(connection, "r");
+    char *record = NULL;
+    size_t capacity = 0;
+    int status = 0; //no "+ exit": the session ran exit
+    while(getline(&record, &capacity, results) > 0){
+        if(sscanf(record, "+ exit %d", &status) == 1){
+            continue;
         }
-        else{
-            commands[i].pid = pid;
+        if(!quiet){
+            fputs(record, stderr);
+        }
+    }
+    pthread_join(sender, NULL);
+    return status;
+}
 
-            if(i < num_commands - 1){ //close the write end of the pipe for the current commands
-                close(pipes[i][1]);   //(since it won't need to write anymore)
-            }
+int main(int argc, char *argv[])
+{
+    char *cmd;
+    struct LineReader reader = { .fd = STDIN_FILENO };
+    struct CommandLine line; //the parsed stages of the current command line
+    struct Parser parser = { 0 }; //keeps its arena and scratch arrays from one line to the next
+    struct JobTable table; //every job the shell started, foreground or background
+    char *serve_path = NULL;
+    char *connect_path = NULL;
 
-            if(i > 0){ //close the read end of the previous pipe (since we read from it already)
-                close(pipes[i - 1][0]);
-            }
+    variables_init(); //before anything reads the environment
+    load_settings();
+    signal(SIGPIPE, SIG_IGN); //a builtin writing into a closed pipe gets EPIPE instead of killing the shell
+                              //(children get SIGPIPE back, see launch_command)
 
-            if(commands[0].need_background_command == true){
-                if( background_process->pids[0] == -1){ //if pid for command 1 hasnt been set
-                    background_process->pids[0] = pid; //keep record of this pid so we could return to it and see if it's finished
-                    strncpy(background_process->command_string, cmd_copy, CMDLINE_MAX - 1);
-                    background_process->command_string[CMDLINE_MAX - 1] = '\0'; //null-terminate the end
-                }
-                else if(background_process->pids[0] == commands[0].pid){ //if the pid of the first command in the background process is the same as this current function
-                    background_process->pids[i] = pid;               // run first command pid, then we are in the right process to keep updating the background pids
-                }
+    static const struct option long_options[] = {
+        { "serve", required_argument, NULL, 'S' },
+        { "connect", required_argument, NULL, 'C' },
+        { 0 }
+    };
+    int option;
+    while((option = getopt_long(argc, argv, "j:uqc:s:", long_options, NULL)) != -1){
+        if(option == 'j'){ //-j N: run up to N lines of a script at once, reported in script order
+            char *end;
+            batch_size = strtol(optarg, &end, 10);
+            if(*end != '\0' || batch_size < 1){
+                usage(argv[0]);
             }
         }
-    }
-
-    if(commands[0].need_background_command == true && background_process->pids[num_commands - 1] == commands[num_commands - 1].pid){
-        commands[0].need_background_command = false; //don't need to enter these if statements anymore (to not overwrite info with future sshell inputs)
-        return;
-    }
-    else{
-        //wait for processes/children to finish
-        for (int i = 0; i < num_commands; i++) {
-            int status;
-            waitpid(commands[i].pid, &status, 0);
-            exit_codes[i] = WEXITSTATUS(status);
+        else if(option == 'u'){ //-u: with -j, report each line as soon as it finishes
+            batch_unordered = true;
         }
-
-        if(background_process->currently_executing == true){
-            check_background_processes(background_process);
+        else if(option == 'q'){ //-q: no completion lines
+            quiet = true;
         }
-
-        /*Completion message*/
-        fprintf(stderr, "+ completed '%s' ", cmd_copy);
-        for (int i = 0; i < num_commands; i++) {
-            fprintf(stderr, "[%d]", exit_codes[i]); //print all the exit codes
+        else if(option == 'c'){ //-c 'command line': run it and exit with its status, like sh -c
+            size_t length = strlen(optarg);
+            reader.buffer = malloc(length + 2);
+            memcpy(reader.buffer, optarg, length);
+            reader.buffer[length++] = '\n'; //it may hold several lines, each one ends in a newline
+            reader.capacity = reader.end = length;
+            reader.eof = true; //nothing to read, it's all in the buffer already
+            reader.fd = -1;
+            quiet = true;
+            sh_statuses = true;
+        }
+        else if(option == 's'){ //-s script: the commands come from a file, stdin stays with the commands
+            reader.fd = open_script(optarg);
+        }
+        else if(option == 'S'){ //--serve socket: run lines for sshell --connect clients
+            serve_path = optarg;
+        }
+        else if(option == 'C'){ //--connect socket: run these lines in a --serve shell
+            connect_path = optarg;
+        }
+        else{
+            usage(argv[0]);
         }
-        fprintf(stderr, "\n");
-        return;
     }
-
-}
-
-
-int main()
-{
-    char cmd[CMDLINE_MAX];
-    char *eof;
-    struct Command commands[4]; //up to 4 possible commands via pipelining
-    struct Background background_process; //only one background job can be given at a time
-    background_process.currently_executing = false; //initialize to false
-    background_process.pids[0] = -1; //pid hasnt been initialized yet
-    commands[0].need_background_command = false;
-    background_process.completed_processes = 0;
+    if(optind < argc && reader.fd == STDIN_FILENO){ //sshell script
+        reader.fd = open_script(argv[optind]);
+    }
+    if(connect_path != NULL){
+        return client(connect_path, &reader);
+    }
+    if(serve_path != NULL){
+        reader.fd = serve(serve_path); //from here on, a session for one client
+        quiet = false; //the completion lines are the results, the client decides whether to print them
+    }
+    job_table_init(&table); //after serve, each session needs an epoll set of its own
+    bool interactive = isatty(reader.fd); //lines typed at a terminal go into the history
+    if(interactive){
+        batch_size = 0; //someone is typing, they want to see each command finish before the next prompt
+    }
+    bool prompt = reader.fd == STDIN_FILENO; //scripts and -c run silently, like sh
+    event_loop_init(&table, &reader);
 
     while (1) {
 
         char *nl;
 
         /* Print prompt */
-        printf("sshell@ucd$ ");
-        fflush(stdout);
+        if(prompt){
+            printf(PROMPT);
+            fflush(stdout);
+        }
 
         /* Get command line */
-        eof = fgets(cmd, CMDLINE_MAX, stdin); //reads user input from stdin into the cmd buffer (up to CMDLINE_MAX characters)
-        if (!eof) //if fgets returns null for eof 
+        cmd = read_command_line(&reader, &table); //reads user input from stdin, a whole line however long it is
+        if(!cmd && !prompt){ //end of the script or -c: done, with the status of the last line
+            drain_batch(&table);
+            check_background_processes(&table);
+            if(completions != NULL){
+                fprintf(completions, "+ exit %d\n", last_status); //the client exits with it
+                fflush(completions);
+            }
+            exit(last_status); //background jobs keep running, like with sh
+        }
+        if (!cmd) //if it returns NULL for eof 
             /* Make EOF equate to exit */
-            strncpy(cmd, "exit\n", CMDLINE_MAX); // exit is set as the ecommand
+            cmd = "exit\n"; // exit is set as the ecommand
 
         /* Print command line if stdin is not provided by terminal */
-        if (!isatty(STDIN_FILENO)) { //checks if the input is coming from a terminal, otherwise (from a file, etc.) it prints it out
+        if (prompt && !isatty(STDIN_FILENO)) { //checks if the input is coming from a terminal, otherwise (from a file, etc.) it prints it out
             printf("%s", cmd);
             fflush(stdout);
         }
 
         /* Remove trailing newline from command line */
-        nl = strchr(cmd, '\n');
+        char *cmd_copy = strdup(cmd); //the parser leaves cmd alone, but this is what gets printed for the job later
+        nl = strchr(cmd_copy, '\n');
         if (nl)
             *nl = '\0';
 
-        char cmd_copy[CMDLINE_MAX];
-        strncpy(cmd_copy, cmd, CMDLINE_MAX); //saving the original buffer line to print out for later
+        /* !!, !N and !prefix bring back an earlier line */
+        if(cmd_copy[strspn(cmd_copy, " \t")] == '!'){
+            char *expanded = history_expand(cmd_copy);
+            free(cmd_copy);
+            if(expanded == NULL){
+                fprintf(stderr, "Error: event not found\n");
+                last_status = 1;
+                continue;
+            }
+            cmd_copy = expanded;
+            printf("%s\n", cmd_copy); //show what is about to run, like other shells do
+            fflush(stdout);
+        }
+        if(interactive){
+            history_add(cmd_copy);
+        }
 
         /* Extract the tokens | Checks for parsing errors as well*/
-        int num_commands = extract_tokens(cmd, commands, &background_process); //extract the commands, and their respective arguments; returns the amount of commands extracted
-        if(num_commands < 0){ continue; } //if this is negative, it means an error occured and we should reprompt the shell instead of executing a command
+        int num_commands = extract_tokens(cmd_copy, &line, &parser); //extract the commands, and their respective arguments; returns the amount of commands extracted
+
+        line.batch = false;
+        if(batch_size > 0 && num_commands > 0){
+            const struct Builtin *builtin = builtin_command(line.commands[0].arguments);
+            if(num_commands == 1 && ((builtin != NULL && builtin->shell) || assignment_command(&line.commands[0]))){
+                drain_batch(&table); //builtins and assignments see (and change) the shell state, so every earlier line has to be done
+            }
+            else if(!line.background){
+                while(table.batch_running >= batch_size){ //all N slots are busy, wait for one to free up
+                    handle_events(&table, -1);
+                    report_finished_jobs(&table);
+                }
+                line.batch = true;
+            }
+        }
 
         if(num_commands == 1){
-            singular_command(commands[0], cmd_copy, &background_process); //only execute one command (which means we can execute built-in commands too)
+            singular_command(&line, cmd_copy, &table); //only execute one command (which means we can execute built-in commands too)
         } else if (num_commands > 1){
-            pipeline(commands, num_commands, cmd_copy, &background_process); //execute the pipeline (no built-in commands)
+            pipeline(&line, cmd_copy, &table); //execute the pipeline (no built-in commands)
         } else if(num_commands == 0){
-            if(background_process.currently_executing == true){
-                check_background_processes(&background_process); //check to see if it ended
-            }   
+            check_background_processes(&table); //check to see if anything ended
         }
-
-        for(int i = 0; i < num_commands; i++) {
-            for(int j = 0; commands[i].arguments[j] != NULL; j++) { //check before freeing
-                    free(commands[i].arguments[j]);
-                    commands[i].arguments[j] = NULL; //prevent double-free
-            }
+        else{
+            last_status = 2; //a parse error, same status sh gives a syntax error
         }
+        //if this is negative, an error occured and we just reprompt the shell
+
+        trace_flush(); //this command is done, write out its events
+        arena_reset(&parser.arena); //frees every argument of this line at once
+        free(cmd_copy);
     }
 
     return EXIT_SUCCESS;